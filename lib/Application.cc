@@ -27,6 +27,8 @@
 #include "Display.hh"
 #include "EventHandler.hh"
 #include "Menu.hh"
+#include "Pen.hh"
+#include "Rect.hh"
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
@@ -43,6 +45,10 @@
 #endif
 #include <sys/time.h>
 #include <sys/wait.h>
+#ifdef    EPOLL
+#  include <sys/epoll.h>
+#  include <sys/signalfd.h>
+#endif // EPOLL
 #include <assert.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -51,6 +57,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#if defined(__GNUC__)
+#  include <cxxabi.h>
+#endif
+
+#include <typeinfo>
+#include <vector>
 
 #if defined(__GNUC__)
 #  if __GNUC__ == 3 && __GNUC_MINOR__ == 3
@@ -61,8 +73,114 @@ static void *workaround __attribute__((__unused__)) = 0;
 #endif
 
 
+namespace bt {
+
+#ifdef    MITSHM
+  bool processShmCompletion(const XEvent * const event);
+#endif // MITSHM
+#ifdef    RENDER_THREADS
+  int renderCompletionFd(void);
+  void processRenderCompletions(void);
+  void forgetRenderWindow(Window window);
+
+  // background image rendering signals completion on a descriptor
+  class RenderCompletionWatcher : public FdWatcher {
+  public:
+    void fdReadable(int)
+    { processRenderCompletions(); }
+  };
+  static RenderCompletionWatcher render_completion_watcher;
+#endif // RENDER_THREADS
+
+  /*
+    Events in a batch with the same key replace each other.  {detail}
+    is the property or configured window, and {epoch} counts the
+    input and structure events that coalescing must not cross.
+  */
+  struct CoalesceKey {
+    Window window;
+    int type;
+    XID detail;
+    unsigned int epoch;
+
+    inline CoalesceKey(Window w, int t, XID d, unsigned int e)
+      : window(w), type(t), detail(d), epoch(e)
+    { }
+    inline bool operator<(const CoalesceKey &x) const {
+      if (window != x.window)
+        return window < x.window;
+      if (type != x.type)
+        return type < x.type;
+      if (detail != x.detail)
+        return detail < x.detail;
+      return epoch < x.epoch;
+    }
+  };
+  typedef std::map<CoalesceKey,size_t> CoalesceMap;
+
+  // bucket n of a latency histogram counts the events that took less
+  // than 2^(n+1) microseconds, the last bucket counts the rest
+  static const unsigned int latency_buckets = 16u;
+
+  struct LatencyHistogram {
+    unsigned long count, total, max;
+    unsigned long buckets[latency_buckets];
+
+    inline LatencyHistogram(void)
+      : count(0ul), total(0ul), max(0ul)
+    { memset(buckets, 0, sizeof(buckets)); }
+
+    inline void add(unsigned long usecs) {
+      unsigned int n = 0u;
+      while (n < latency_buckets - 1 && (usecs >> (n + 1)) != 0)
+        ++n;
+      ++buckets[n];
+      ++count;
+      total += usecs;
+      if (usecs > max)
+        max = usecs;
+    }
+  };
+
+  /*
+    Delivery latencies by event type and by the class of the event
+    handler registered for the event window.  There are only a few
+    handler classes, so they are kept in a list.
+  */
+  class EventStatistics {
+  public:
+    // extension events are counted as type 0
+    LatencyHistogram types[LASTEvent];
+    typedef std::vector<std::pair<const std::type_info *,
+                                  LatencyHistogram> > HandlerList;
+    HandlerList handlers;
+    unsigned long slow_threshold; // microseconds, 0 when disabled
+
+    inline EventStatistics(void)
+      : slow_threshold(0ul)
+    { }
+
+    void add(int type, const std::type_info &handler, unsigned long usecs) {
+      types[(type > 0 && type < LASTEvent) ? type : 0].add(usecs);
+      HandlerList::iterator it = handlers.begin();
+      for (; it != handlers.end(); ++it) {
+        if (*it->first == handler)
+          break;
+      }
+      if (it == handlers.end())
+        it = handlers.insert(it, std::make_pair(&handler, LatencyHistogram()));
+      it->second.add(usecs);
+    }
+  };
+
+} // namespace bt
+
+
 static bt::Application *base_app = 0;
 static sig_atomic_t pending_signals = 0;
+// the signal mask before the handled signals were blocked
+static sigset_t original_signal_mask;
+static bool signals_blocked = false;
 
 
 static int handleXErrors(Display *d, XErrorEvent *e) {
@@ -83,6 +201,61 @@ static int handleXErrors(Display *d, XErrorEvent *e) {
 }
 
 
+static const char *eventName(int type) {
+  static const char * const names[] = {
+    "Extension", "Extension", "KeyPress", "KeyRelease", "ButtonPress",
+    "ButtonRelease", "MotionNotify", "EnterNotify", "LeaveNotify",
+    "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExpose",
+    "NoExpose", "VisibilityNotify", "CreateNotify", "DestroyNotify",
+    "UnmapNotify", "MapNotify", "MapRequest", "ReparentNotify",
+    "ConfigureNotify", "ConfigureRequest", "GravityNotify",
+    "ResizeRequest", "CirculateNotify", "CirculateRequest",
+    "PropertyNotify", "SelectionClear", "SelectionRequest",
+    "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify",
+    "GenericEvent"
+  };
+  if (type < 0 || type >= static_cast<int>(sizeof(names) / sizeof(names[0])))
+    return names[0];
+  return names[type];
+}
+
+
+static std::string className(const std::type_info &type) {
+#if defined(__GNUC__)
+  int status;
+  char * const name = abi::__cxa_demangle(type.name(), 0, 0, &status);
+  if (name) {
+    const std::string ret(name);
+    free(name);
+    return ret;
+  }
+#endif
+  return type.name();
+}
+
+
+static void appendHistogram(std::string &text, const std::string &name,
+                            const bt::LatencyHistogram &histogram) {
+  if (histogram.count == 0)
+    return;
+  text += name;
+  if (name.size() < 24)
+    text.append(24 - name.size(), ' ');
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), " %9lu %7lu %8lu  ", histogram.count,
+           histogram.total / histogram.count, histogram.max);
+  text += buffer;
+  unsigned int last = bt::latency_buckets;
+  while (last > 0 && histogram.buckets[last - 1] == 0)
+    --last;
+  for (unsigned int i = 0; i < last; ++i) {
+    snprintf(buffer, sizeof(buffer), " %lu", histogram.buckets[i]);
+    text += buffer;
+  }
+  text += '\n';
+}
+
+
 // generic signal handler - this sets a bit in pending_signals, which
 // will be handled later by the event loop (ie. if signal 2 is caught,
 // bit 2 is set)
@@ -90,10 +263,62 @@ static void signalhandler(int sig)
 { pending_signals |= (1 << sig); }
 
 
+#ifdef    EPOLL
+// the signals handled by bt::Application::process_signal()
+static void handledSignals(sigset_t *set) {
+  sigemptyset(set);
+  sigaddset(set, SIGHUP);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGQUIT);
+  sigaddset(set, SIGTERM);
+  sigaddset(set, SIGPIPE);
+  sigaddset(set, SIGCHLD);
+  sigaddset(set, SIGUSR1);
+  sigaddset(set, SIGUSR2);
+  sigaddset(set, SIGWINCH);
+}
+
+
+// the most events returned by one epoll_wait(2)
+static const int max_epoll_events = 16;
+#endif // EPOLL
+
+
+// more exposed rectangles than this are merged into their bounding box
+static const unsigned int max_expose_rects = 8u;
+
+/*
+  Adds an exposed rectangle to the list.  Rectangles that overlap are
+  merged, so the list is always disjoint.
+*/
+static void addExposeRect(std::vector<bt::Rect> &rects, bt::Rect rect) {
+  std::vector<bt::Rect>::iterator it = rects.begin();
+  while (it != rects.end()) {
+    if (it->intersects(rect)) {
+      // the merged rectangle may overlap ones that were already checked
+      rect |= *it;
+      rects.erase(it);
+      it = rects.begin();
+    } else {
+      ++it;
+    }
+  }
+  rects.push_back(rect);
+
+  if (rects.size() > max_expose_rects) {
+    for (it = rects.begin(); it != rects.end(); ++it)
+      rect |= *it;
+    rects.assign(1, rect);
+  }
+}
+
+
 bt::Application::Application(const std::string &app_name, const char *dpy_name,
                              bool multi_head)
   : _app_name(bt::basename(app_name)), run_state(STARTUP),
-    xserver_time(CurrentTime), menu_grab(false)
+    xserver_time(CurrentTime), epoll_fd(-1), signal_fd(-1),
+    event_batch_pos(0), events_received(0), events_dispatched(0),
+    event_stats(new EventStatistics), menu_grab(false)
 {
   assert(base_app == 0);
   ::base_app = this;
@@ -114,6 +339,37 @@ bt::Application::Application(const std::string &app_name, const char *dpy_name,
   sigaction(SIGCHLD, &action, NULL);
   sigaction(SIGUSR1, &action, NULL);
   sigaction(SIGUSR2, &action, NULL);
+  sigaction(SIGWINCH, &action, NULL);
+
+#ifdef    EPOLL
+  /*
+    signals are blocked and read from a signalfd instead, so that they
+    wake up the event loop like any other descriptor.  if either call
+    fails, the signal handlers above are used
+  */
+  sigset_t signals;
+  handledSignals(&signals);
+  if (sigprocmask(SIG_BLOCK, &signals, &original_signal_mask) == 0) {
+    signals_blocked = true;
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+      restoreSignalMask();
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd != -1) {
+    const int fds[] = { XConnectionNumber(_display->XDisplay()), signal_fd };
+    for (unsigned int i = 0; i < 2; ++i) {
+      if (fds[i] == -1)
+        continue;
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.u64 = 0;
+      ev.data.fd = fds[i];
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &ev);
+    }
+  }
+#endif // EPOLL
 
   kbd.major = 1;
   kbd.minor = 0;
@@ -179,19 +435,30 @@ bt::Application::Application(const std::string &app_name, const char *dpy_name,
     XFreeModifiermap(const_cast<XModifierKeymap*>(modmap));
 
   XrmInitialize();
-
-  ::timeval tv;
-  gettimeofday(&tv, 0);
-  currentTime = tv;
 }
 
 
 bt::Application::~Application(void) {
+  if (epoll_fd != -1)
+    close(epoll_fd);
+  if (signal_fd != -1)
+    close(signal_fd);
+  restoreSignalMask();
+
+  delete event_stats;
   delete _display;
   ::base_app = 0;
 }
 
 
+void bt::Application::restoreSignalMask(void) {
+  if (!signals_blocked)
+    return;
+  sigprocmask(SIG_SETMASK, &original_signal_mask, NULL);
+  signals_blocked = false;
+}
+
+
 ::Display *bt::Application::XDisplay(void) const
 { return _display->XDisplay(); }
 
@@ -209,8 +476,6 @@ void bt::Application::run(void) {
 
   setRunState(RUNNING);
 
-  const int xfd = XConnectionNumber(_display->XDisplay());
-
   while (run_state == RUNNING) {
     if (pending_signals) {
       // handle any pending signals
@@ -238,49 +503,33 @@ void bt::Application::run(void) {
     }
 
     do {
-      XEvent e;
       while (run_state == RUNNING
-             && XEventsQueued(_display->XDisplay(), QueuedAlready)) {
-        XNextEvent(_display->XDisplay(), &e);
-        process_event(&e);
-      }
+             && XEventsQueued(_display->XDisplay(), QueuedAlready))
+        processEventBatch();
     } while (run_state == RUNNING
              && XEventsQueued(_display->XDisplay(), QueuedAfterFlush));
 
     if (run_state != RUNNING)
       break;
 
-    fd_set rfds;
-    ::timeval now, tm, *timeout = 0;
-
-    FD_ZERO(&rfds);
-    FD_SET(xfd, &rfds);
+#ifdef    RENDER_THREADS
+    // the render queue is created with the first background render
+    const int rfd = renderCompletionFd();
+    if (rfd != -1 && fdwatchers.find(rfd) == fdwatchers.end())
+      addFdWatcher(rfd, &render_completion_watcher);
+#endif // RENDER_THREADS
 
+    ::timeval tm, *timeout = 0;
     if (!timerList.empty()) {
       const bt::Timer* const timer = timerList.top();
-
-      gettimeofday(&now, 0);
-      tm = timer->timeRemaining(now);
-
+      tm = timer->timeRemaining(monotonicTime());
       timeout = &tm;
     }
 
-    int ret = select(xfd + 1, &rfds, 0, 0, timeout);
-    if (ret < 0) {
-      errno = 0;
-      continue; // perhaps a signal interrupted select(2)
-    }
+    waitForEvents(timeout);
 
     // check for timer timeout
-    gettimeofday(&now, 0);
-
-    {
-      // if the clock has rolled back, adjust all timers
-      timeval tv = now;
-      if (tv < currentTime)
-        adjustTimers(tv - currentTime);
-      currentTime = tv;
-    }
+    const timeval now = monotonicTime();
 
     /*
       there is a small chance for deadlock here:
@@ -298,6 +547,9 @@ void bt::Application::run(void) {
       timerList.pop();
 
       timer->fireTimeout();
+      // the handler may have started the timer again
+      if (timerList.contains(timer))
+        continue;
       timer->halt();
       if (timer->isRecurring())
         timer->start();
@@ -307,7 +559,365 @@ void bt::Application::run(void) {
   shutdown();
 }
 
+/*
+ * Waits until the X connection, the signalfd or a watched descriptor
+ * is readable, or until the timeout expires, and calls the watchers
+ * of the readable descriptors.
+ */
+void bt::Application::waitForEvents(const ::timeval *timeout) {
+#ifdef    EPOLL
+  if (epoll_fd != -1) {
+    const int ms = (timeout
+                    ? static_cast<int>(timeout->tv_sec * 1000
+                                       + (timeout->tv_usec + 999) / 1000)
+                    : -1);
+    epoll_event events[max_epoll_events];
+    const int count = epoll_wait(epoll_fd, events, max_epoll_events, ms);
+    for (int i = 0; i < count; ++i)
+      dispatchFd(events[i].data.fd);
+    return;
+  }
+#endif // EPOLL
+
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  const int xfd = XConnectionNumber(_display->XDisplay());
+  FD_SET(xfd, &rfds);
+  int maxfd = xfd;
+  if (signal_fd != -1) {
+    FD_SET(signal_fd, &rfds);
+    if (signal_fd > maxfd)
+      maxfd = signal_fd;
+  }
+  FdWatcherMap::const_iterator it = fdwatchers.begin();
+  for (; it != fdwatchers.end(); ++it) {
+    FD_SET(it->first, &rfds);
+    if (it->first > maxfd)
+      maxfd = it->first;
+  }
+
+  ::timeval tm, *ptm = 0;
+  if (timeout) {
+    // select(2) may modify the timeout
+    tm = *timeout;
+    ptm = &tm;
+  }
+
+  if (select(maxfd + 1, &rfds, 0, 0, ptm) < 0) {
+    errno = 0;
+    return; // perhaps a signal interrupted select(2)
+  }
+
+  // watchers may add or remove watchers, so find the ready ones first
+  std::vector<int> ready;
+  if (signal_fd != -1 && FD_ISSET(signal_fd, &rfds))
+    ready.push_back(signal_fd);
+  for (it = fdwatchers.begin(); it != fdwatchers.end(); ++it) {
+    if (FD_ISSET(it->first, &rfds))
+      ready.push_back(it->first);
+  }
+  for (unsigned int i = 0; i < ready.size(); ++i)
+    dispatchFd(ready[i]);
+}
+
+
+void bt::Application::dispatchFd(int fd) {
+#ifdef    EPOLL
+  if (fd == signal_fd) {
+    // handled by the event loop, like the signal handler would
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+      pending_signals |= (1 << info.ssi_signo);
+    return;
+  }
+#endif // EPOLL
+
+  // the X connection has no watcher, its events are read by run()
+  const FdWatcherMap::iterator it = fdwatchers.find(fd);
+  if (it != fdwatchers.end())
+    it->second->fdReadable(fd);
+}
+
+
+void bt::Application::addFdWatcher(int fd, FdWatcher *watcher) {
+  assert(fd >= 0 && watcher != 0);
+  const bool added = fdwatchers.find(fd) == fdwatchers.end();
+  fdwatchers[fd] = watcher;
+
+#ifdef    EPOLL
+  if (added && epoll_fd != -1) {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+#else
+  (void) added;
+#endif // EPOLL
+}
+
+
+void bt::Application::removeFdWatcher(int fd) {
+  if (fdwatchers.erase(fd) == 0)
+    return;
+
+#ifdef    EPOLL
+  if (epoll_fd != -1) {
+    // older kernels require a non-null event
+    epoll_event ev;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+  }
+#endif // EPOLL
+}
+
+
+/*
+ * Reads all events queued by Xlib, coalesces them and delivers the
+ * remaining ones to process_event().
+ */
+void bt::Application::processEventBatch(void) {
+  ::Display * const dpy = _display->XDisplay();
+  const int count = XEventsQueued(dpy, QueuedAlready);
+  event_batch.clear();
+  event_batch.reserve(count);
+  for (int i = 0; i < count; ++i) {
+    BatchedEvent batched;
+    XNextEvent(dpy, &batched.event);
+    ++events_received;
+#ifdef    MITSHM
+    // bt::Image may wait for these with XIfEvent(), so they must not
+    // be held in the batch
+    if (processShmCompletion(&batched.event)) {
+      ++events_dispatched;
+      continue;
+    }
+#endif // MITSHM
+    batched.dispatch = true;
+    batched.next = 0;
+    event_batch.push_back(batched);
+  }
+
+  coalesceEventBatch();
+
+  for (event_batch_pos = 0;
+       event_batch_pos < event_batch.size() && run_state == RUNNING;
+       ++event_batch_pos) {
+    BatchedEvent &batched = event_batch[event_batch_pos];
+    if (!batched.dispatch)
+      continue;
+    // events taken by checkTypedWindowEvent() are not dispatched again
+    batched.dispatch = false;
+    ++events_dispatched;
+
+    // the event may destroy the handler, so look at it first
+    const int type = batched.event.type;
+    const Window window = batched.event.xany.window;
+    const EventHandler * const handler = findEventHandler(window);
+    const std::type_info &handler_type =
+      handler ? typeid(*handler) : typeid(*this);
+
+    const timeval start = monotonicTime();
+    process_event(&batched.event);
+    const timeval end = monotonicTime();
+
+    const long usecs = ((end.tv_sec - start.tv_sec) * 1000000l
+                        + (end.tv_usec - start.tv_usec));
+    const unsigned long elapsed = usecs > 0 ? usecs : 0ul;
+    event_stats->add(type, handler_type, elapsed);
+    if (event_stats->slow_threshold != 0
+        && elapsed >= event_stats->slow_threshold) {
+      fprintf(stderr,
+              gettext("%s: %s for window 0x%lx (%s) took %lu.%03lu ms\n"),
+              _app_name.c_str(), eventName(type), window,
+              className(handler_type).c_str(), elapsed / 1000, elapsed % 1000);
+    }
+  }
+  event_batch.clear();
+  event_batch_pos = 0;
+}
+
+
+/*
+ * Coalesces the events in the batch in a single pass:
+ *
+ * - only the last MotionNotify, ConfigureNotify and PropertyNotify
+ *   (per property) of a window is kept;
+ *
+ * - ConfigureRequests for the same window are merged into the last
+ *   one, keeping the values of the earlier requests that it does not
+ *   override;
+ *
+ * - the exposures of a window are merged into the first one;
+ *
+ * - an EnterNotify that is followed by the matching LeaveNotify is
+ *   dropped together with it, so that sweeping the pointer across
+ *   windows does not trigger focus changes or auto raising in each
+ *   of them.
+ *
+ * Events are never coalesced across button or key events, or across
+ * changes to the window hierarchy.
+ */
+void bt::Application::coalesceEventBatch(void) {
+  if (event_batch.size() < 2)
+    return;
+
+  CoalesceMap latest;
+  unsigned int epoch = 0;
+  for (size_t i = 0; i < event_batch.size(); ++i) {
+    XEvent &event = event_batch[i].event;
+    const Window window = event.xany.window;
+    switch (event.type) {
+    case ButtonPress:
+    case ButtonRelease:
+    case KeyPress:
+    case KeyRelease:
+    case MapRequest:
+    case MapNotify:
+    case UnmapNotify:
+    case ReparentNotify:
+    case DestroyNotify:
+      ++epoch;
+      break;
+
+    case MotionNotify: {
+      // the pointer did not only pass through this window
+      latest.erase(CoalesceKey(window, EnterNotify, 0, epoch));
+
+      size_t &last = latest[CoalesceKey(window, MotionNotify, 0, epoch)];
+      if (last != 0)
+        event_batch[last - 1].dispatch = false;
+      last = i + 1;
+      break;
+    }
+
+    case EnterNotify:
+    case LeaveNotify: {
+      const CoalesceKey key(window, EnterNotify, 0, epoch);
+      if (event.xcrossing.mode != NotifyNormal
+          || event.xcrossing.detail == NotifyInferior) {
+        latest.erase(key);
+        break;
+      }
+      if (event.type == EnterNotify) {
+        latest[key] = i + 1;
+        break;
+      }
+      const CoalesceMap::iterator it = latest.find(key);
+      if (it == latest.end())
+        break;
+      event_batch[it->second - 1].dispatch = false;
+      event_batch[i].dispatch = false;
+      latest.erase(it);
+      break;
+    }
+
+    case PropertyNotify: {
+      size_t &last = latest[CoalesceKey(window, PropertyNotify,
+                                        event.xproperty.atom, epoch)];
+      if (last != 0)
+        event_batch[last - 1].dispatch = false;
+      last = i + 1;
+      break;
+    }
+
+    case ConfigureNotify: {
+      size_t &last = latest[CoalesceKey(window, ConfigureNotify,
+                                        event.xconfigure.window, epoch)];
+      if (last != 0)
+        event_batch[last - 1].dispatch = false;
+      last = i + 1;
+      break;
+    }
+
+    case ConfigureRequest: {
+      size_t &last =
+        latest[CoalesceKey(window, ConfigureRequest,
+                           event.xconfigurerequest.window, epoch)];
+      if (last != 0) {
+        BatchedEvent &earlier = event_batch[last - 1];
+        const XConfigureRequestEvent &e = earlier.event.xconfigurerequest;
+        XConfigureRequestEvent &r = event.xconfigurerequest;
+        const unsigned long missing = e.value_mask & ~r.value_mask;
+        if (missing & CWX)
+          r.x = e.x;
+        if (missing & CWY)
+          r.y = e.y;
+        if (missing & CWWidth)
+          r.width = e.width;
+        if (missing & CWHeight)
+          r.height = e.height;
+        if (missing & CWBorderWidth)
+          r.border_width = e.border_width;
+        if (missing & CWSibling)
+          r.above = e.above;
+        if (missing & CWStackMode)
+          r.detail = e.detail;
+        r.value_mask |= missing;
+        earlier.dispatch = false;
+      }
+      last = i + 1;
+      break;
+    }
+
+    case Expose: {
+      // chain the exposures onto the first one, see process_event()
+      size_t &tail = latest[CoalesceKey(window, Expose, 0, epoch)];
+      if (tail != 0) {
+        event_batch[tail - 1].next = i;
+        event_batch[i].dispatch = false;
+      }
+      tail = i + 1;
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+}
+
+
+bool bt::Application::checkTypedWindowEvent(Window window, int type,
+                                            XEvent *event) {
+  for (size_t i = event_batch_pos + 1; i < event_batch.size(); ++i) {
+    BatchedEvent &batched = event_batch[i];
+    if (batched.dispatch && batched.event.type == type
+        && batched.event.xany.window == window) {
+      batched.dispatch = false;
+      *event = batched.event;
+      return true;
+    }
+  }
+  return XCheckTypedWindowEvent(_display->XDisplay(), window, type, event);
+}
+
+
+bool bt::Application::checkIfEvent(XEvent *event,
+                                   Bool (*predicate)(::Display *, XEvent *,
+                                                     XPointer),
+                                   XPointer arg) {
+  ::Display * const dpy = _display->XDisplay();
+  for (size_t i = event_batch_pos + 1; i < event_batch.size(); ++i) {
+    BatchedEvent &batched = event_batch[i];
+    if (batched.dispatch && predicate(dpy, &batched.event, arg)) {
+      batched.dispatch = false;
+      *event = batched.event;
+      return true;
+    }
+  }
+  return XCheckIfEvent(dpy, event, predicate, arg);
+}
+
+
 void bt::Application::process_event(XEvent *event) {
+#ifdef    MITSHM
+  // MIT-SHM completion events are sent to pixmaps rendered by
+  // bt::Image, which never have an event handler
+  if (processShmCompletion(event))
+    return;
+#endif // MITSHM
+
   bt::EventHandler *handler = findEventHandler(event->xany.window);
   if (!handler)
     return;
@@ -365,18 +975,6 @@ void bt::Application::process_event(XEvent *event) {
 
   case MotionNotify: {
     xserver_time = event->xmotion.time;
-    // compress motion notify events
-    XEvent realevent;
-    unsigned int i = 0;
-    while (XCheckTypedWindowEvent(_display->XDisplay(), event->xmotion.window,
-                                  MotionNotify, &realevent)) {
-      ++i;
-    }
-
-    // if we have compressed some motion events, use the last one
-    if (i > 0)
-      event = &realevent;
-
     // strip the lock key modifiers
     event->xbutton.state &= ~(NumLockMask | ScrollLockMask | LockMask);
     handler->motionNotifyEvent(&event->xmotion);
@@ -438,51 +1036,38 @@ void bt::Application::process_event(XEvent *event) {
   }
 
   case Expose: {
-    // compress expose events
-    XEvent realevent;
-    unsigned int i = 0;
-    int ex1, ey1, ex2, ey2;
-    ex1 = event->xexpose.x;
-    ey1 = event->xexpose.y;
-    ex2 = ex1 + event->xexpose.width - 1;
-    ey2 = ey1 + event->xexpose.height - 1;
-    while (XCheckTypedWindowEvent(_display->XDisplay(), event->xexpose.window,
-                                  Expose, &realevent)) {
-      ++i;
-
-      // merge expose area
-      ex1 = std::min(realevent.xexpose.x, ex1);
-      ey1 = std::min(realevent.xexpose.y, ey1);
-      ex2 = std::max(realevent.xexpose.x + realevent.xexpose.width - 1, ex2);
-      ey2 = std::max(realevent.xexpose.y + realevent.xexpose.height - 1, ey2);
+    // compress expose events into a short list of disjoint rectangles
+    std::vector<Rect> rects;
+    addExposeRect(rects, Rect(event->xexpose.x, event->xexpose.y,
+                              event->xexpose.width, event->xexpose.height));
+    if (event_batch_pos < event_batch.size()
+        && event == &event_batch[event_batch_pos].event) {
+      // add the exposures that coalesceEventBatch() merged into this one
+      size_t i = event_batch[event_batch_pos].next;
+      for (; i != 0; i = event_batch[i].next) {
+        const XExposeEvent &e = event_batch[i].event.xexpose;
+        addExposeRect(rects, Rect(e.x, e.y, e.width, e.height));
+      }
     }
-    if (i > 0)
-      event = &realevent;
-
-    // use the merged area
-    event->xexpose.x = ex1;
-    event->xexpose.y = ey1;
-    event->xexpose.width = ex2 - ex1 + 1;
-    event->xexpose.height = ey2 - ey1 + 1;
 
-    handler->exposeEvent(&event->xexpose);
+    /*
+      deliver one event per rectangle.  as in the X protocol, 'count'
+      is the number of events that follow, so handlers that repaint the
+      whole window can wait for the last one
+    */
+    XExposeEvent expose = event->xexpose;
+    for (unsigned int i = 0; i < rects.size(); ++i) {
+      expose.x = rects[i].x();
+      expose.y = rects[i].y();
+      expose.width = rects[i].width();
+      expose.height = rects[i].height();
+      expose.count = rects.size() - i - 1;
+      handler->exposeEvent(&expose);
+    }
     break;
   }
 
   case ConfigureNotify: {
-    // compress configure notify events
-    XEvent realevent;
-    unsigned int i = 0;
-    while (XCheckTypedWindowEvent(_display->XDisplay(),
-                                  event->xconfigure.window,
-                                  ConfigureNotify, &realevent)) {
-      ++i;
-    }
-
-    // if we have compressed some configure notify events, use the last one
-    if (i > 0)
-      event = &realevent;
-
     handler->configureNotifyEvent(&event->xconfigure);
     break;
   }
@@ -561,6 +1146,41 @@ void bt::Application::ungrabButton(unsigned int button, unsigned int modifiers,
 }
 
 
+void bt::Application::setSlowEventThreshold(unsigned int msecs)
+{ event_stats->slow_threshold = msecs * 1000ul; }
+
+
+unsigned int bt::Application::slowEventThreshold(void) const
+{ return event_stats->slow_threshold / 1000ul; }
+
+
+void bt::Application::dumpEventStatistics(void) const {
+  std::string text;
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer),
+           "events received %lu, dispatched %lu\n"
+           "%-24s %9s %7s %8s   histogram (< 2^(n+1) us)\n",
+           events_received, events_dispatched,
+           "type/handler", "count", "mean us", "max us");
+  text += buffer;
+  for (int type = 0; type < LASTEvent; ++type)
+    appendHistogram(text, eventName(type), event_stats->types[type]);
+  EventStatistics::HandlerList::const_iterator it =
+    event_stats->handlers.begin();
+  for (; it != event_stats->handlers.end(); ++it)
+    appendHistogram(text, className(*it->first), it->second);
+
+  fprintf(stderr, "%s: %s", _app_name.c_str(), text.c_str());
+
+  ::Display * const dpy = _display->XDisplay();
+  const Atom property = XInternAtom(dpy, "_BT_EVENT_STATISTICS", False);
+  XChangeProperty(dpy, _display->screenInfo(0).rootWindow(), property,
+                  XA_STRING, 8, PropModeReplace,
+                  reinterpret_cast<const unsigned char *>(text.c_str()),
+                  text.length());
+}
+
+
 bool bt::Application::process_signal(int signal) {
   switch (signal) {
   case SIGHUP:
@@ -573,6 +1193,10 @@ bool bt::Application::process_signal(int signal) {
     setRunState(SHUTDOWN);
     break;
 
+  case SIGWINCH:
+    dumpEventStatistics();
+    break;
+
   case SIGCHLD:
     int unused;
     while (waitpid(-1, &unused, WNOHANG | WUNTRACED) > 0)
@@ -590,21 +1214,26 @@ bool bt::Application::process_signal(int signal) {
 
 void bt::Application::insertEventHandler(Window window,
                                          bt::EventHandler *handler) {
-  eventhandlers.insert(std::pair<Window,bt::EventHandler*>(window, handler));
+  bt::EventHandler *&slot = eventhandlers[window];
+  if (!slot)
+    slot = handler;
 }
 
 
 void bt::Application::removeEventHandler(Window window) {
   eventhandlers.erase(window);
+  // the window is about to be destroyed
+  Pen::releaseXftDraw(window);
+#ifdef    RENDER_THREADS
+  forgetRenderWindow(window);
+#endif // RENDER_THREADS
 }
 
 
 bt::EventHandler *bt::Application::findEventHandler(Window window)
 {
-  EventHandlerMap::iterator it = eventhandlers.find(window);
-  if (it == eventhandlers.end())
-    return 0;
-  return it->second;
+  bt::EventHandler **handler = eventhandlers.find(window);
+  return handler ? *handler : 0;
 }
 
 
@@ -643,21 +1272,3 @@ void bt::Application::closeMenu(Menu *menu) {
 }
 
 
-void bt::Application::adjustTimers(const timeval &offset)
-{
-  // since we don't allow TimerQueues to be copied, we have to do it
-  // this way
-  TimerQueue tmp;
-  while (!timerList.empty()) {
-    Timer *t = timerList.top();
-    timerList.pop();
-    t->adjustStartTime(offset);
-    tmp.push(t);
-  }
-  assert(timerList.empty());
-  while (!tmp.empty()) {
-    Timer *t = tmp.top();
-    tmp.pop();
-    timerList.push(t);
-  }
-}
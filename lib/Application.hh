@@ -27,16 +27,30 @@
 
 #include "Timer.hh"
 #include "Util.hh"
+#include "XIDTable.hh"
 
+#include <deque>
 #include <map>
+#include <vector>
 
 namespace bt {
 
   // forward declarations
   class Display;
   class EventHandler;
+  class EventStatistics;
   class Menu;
 
+  /*
+    Receives notification from the event loop when a file descriptor
+    is ready for reading.  See bt::Application::addFdWatcher().
+  */
+  class FdWatcher {
+  public:
+    inline virtual ~FdWatcher(void) { }
+    virtual void fdReadable(int fd) = 0;
+  };
+
   /*
     The application object.  It provides event delivery, timer
     activation and signal handling functionality to fit most
@@ -60,12 +74,35 @@ namespace bt {
     RunState run_state;
     Time xserver_time;
 
-    typedef std::map<Window,EventHandler*> EventHandlerMap;
-    EventHandlerMap eventhandlers;
+    typedef XIDTable<EventHandler*> EventHandlerTable;
+    EventHandlerTable eventhandlers;
+
+    typedef std::map<int,FdWatcher*> FdWatcherMap;
+    FdWatcherMap fdwatchers;
+    // -1 when epoll or signalfd are not available
+    int epoll_fd, signal_fd;
+    void waitForEvents(const ::timeval *timeout);
+    void dispatchFd(int fd);
 
-    timeval currentTime;
     TimerQueue timerList;
-    void adjustTimers(const timeval &offset);
+
+    /*
+      Events read from the X queue by processEventBatch().  Events
+      that were coalesced into another are not dispatched; exposures
+      merged into the first exposure of a window are chained through
+      {next}.
+    */
+    struct BatchedEvent {
+      XEvent event;
+      bool dispatch;
+      size_t next;
+    };
+    std::vector<BatchedEvent> event_batch;
+    size_t event_batch_pos;
+    unsigned long events_received, events_dispatched;
+    EventStatistics *event_stats;
+    void processEventBatch(void);
+    void coalesceEventBatch(void);
 
     typedef std::deque<Menu*> MenuStack;
     MenuStack menus;
@@ -144,10 +181,57 @@ namespace bt {
     void ungrabButton(unsigned int button, unsigned int modifiers,
                       Window grab_window) const;
 
+    /*
+      The signals handled by the application may be blocked, to read
+      them from a signalfd.  The signal mask is inherited across
+      exec(), so the original mask must be restored before replacing
+      the process with another program.
+    */
+    static void restoreSignalMask(void);
+
     void run(void);
     inline void quit(void)
     { setRunState( SHUTDOWN ); }
 
+    /*
+      The number of events read from the X server, and the number
+      left to deliver after coalescing.
+    */
+    inline unsigned long eventsReceived(void) const
+    { return events_received; }
+    inline unsigned long eventsDispatched(void) const
+    { return events_dispatched; }
+
+    /*
+      Events that take {msecs} milliseconds or longer to deliver are
+      reported on stderr.  A value of 0 disables the report.
+    */
+    void setSlowEventThreshold(unsigned int msecs);
+    unsigned int slowEventThreshold(void) const;
+    /*
+      Writes the delivery latency histograms of each event type and
+      event handler class to stderr and to the _BT_EVENT_STATISTICS
+      property of the first root window.  This is done when the
+      application receives SIGWINCH.
+    */
+    void dumpEventStatistics(void) const;
+
+    /*
+      Removes the first pending event of type {type} for window
+      {window} and stores it in {event}.  Returns false if there is no
+      such event.  Event handlers must use this instead of
+      XCheckTypedWindowEvent(), which does not see the events already
+      read into the current batch.
+    */
+    bool checkTypedWindowEvent(Window window, int type, XEvent *event);
+    /*
+      Like XCheckIfEvent(), but also looks at the events already read
+      into the current batch.
+    */
+    bool checkIfEvent(XEvent *event,
+                      Bool (*predicate)(::Display *, XEvent *, XPointer),
+                      XPointer arg);
+
     inline unsigned int scrollLockMask(void) const
     { return ScrollLockMask; }
     inline unsigned int numLockMask(void) const
@@ -171,6 +255,18 @@ namespace bt {
       handler has been registered, this function returns zero.
     */
     EventHandler *findEventHandler(Window window);
+
+    /*
+      Calls {watcher} from the event loop whenever file descriptor
+      {fd} is ready for reading.  Adding a watcher for a descriptor
+      that is already watched replaces the previous watcher.
+    */
+    void addFdWatcher(int fd, FdWatcher *watcher);
+    /*
+      Stops watching file descriptor {fd}.  This must be called before
+      the descriptor is closed.
+    */
+    void removeFdWatcher(int fd);
   };
 
 } // namespace bt
@@ -27,6 +27,7 @@
 #include "Display.hh"
 
 #include <map>
+#include <vector>
 
 #include <X11/Xlib.h>
 
@@ -67,48 +68,81 @@ namespace bt {
     */
     void clear(bool force);
 
+    /*
+      Colormaps other than the screen colormap, like the colormaps of
+      ARGB client frames, have a cache of their own.  It is reference
+      counted by the users of the colormap, and colors allocated in
+      it are freed when the last user removes the colormap.
+    */
+    void addColormap(unsigned int screen, Colormap colormap,
+                     const Visual *visual, int depth);
+    void removeColormap(Colormap colormap);
+    unsigned long find(Colormap colormap, int r, int g, int b);
+
   private:
+    /*
+      On TrueColor visuals, the pixel for a color is computed from
+      the channel masks of the visual, the same way the X server
+      does, so no colors are allocated and nothing is cached.  Like
+      the server, all bits outside the channel masks are set on
+      32-plane visuals, so that the color is opaque.
+    */
+    struct TrueColorFormat {
+      bool valid;
+      unsigned int shift[3];
+      unsigned int max[3];
+      unsigned long alpha;
+    };
+    const TrueColorFormat &trueColorFormat(unsigned int screen);
+    static void trueColorFormat(TrueColorFormat &format,
+                                const Visual *visual, int depth);
+    static inline unsigned long trueColorPixel(const TrueColorFormat &format,
+                                               int r, int g, int b) {
+      // the closest value for each channel
+      const int rgb[3] = { r, g, b };
+      unsigned long pixel = format.alpha;
+      for (unsigned int i = 0; i < 3; ++i) {
+        pixel |= (((rgb[i] * format.max[i] + 127) / 255)
+                  << format.shift[i]);
+      }
+      return pixel;
+    }
+
     const Display &_display;
+    std::vector<TrueColorFormat> formats;
 
-    struct RGB {
-      const unsigned int screen;
-      const int r, g, b;
-
-      inline RGB(void)
-        : screen(~0u), r(-1), g(-1), b(-1)
-      { }
-      inline RGB(const unsigned int s, const int x, const int y, const int z)
-        : screen(s), r(x), g(y), b(z)
-      { }
-      inline RGB(const RGB &x)
-        : screen(x.screen), r(x.r), g(x.g), b(x.b)
-      { }
-
-      inline bool operator==(const RGB &x) const
-      { return screen == x.screen && r == x.r && g == x.g && b == x.b; }
-
-      inline bool operator<(const RGB &x) const {
-        const unsigned long p1 =
-          (screen << 24 | r << 16 | g << 8 | b) & 0xffffffff;
-        const unsigned long p2 =
-          (x.screen << 24 | x.r << 16 | x.g << 8 | x.b) & 0xffffffff;
-        return p1 < p2;
-      }
+    /*
+      Allocated colors are kept in a hash table, keyed by screen and
+      rgb packed into one word.
+    */
+    struct CacheItem {
+      unsigned long key;
+      unsigned long pixel;
+      unsigned int count;
     };
-    struct PixelRef {
-      const unsigned long pixel;
+    typedef std::vector<CacheItem> Bucket;
+    enum { BucketCount = 64 };
+    Bucket cache[BucketCount];
+    unsigned int cache_size;
+
+    static inline unsigned long key(unsigned int screen,
+                                    int r, int g, int b)
+    { return (screen << 24 | r << 16 | g << 8 | b) & 0xffffffff; }
+    static inline Bucket &bucket(Bucket *cache, unsigned long key)
+    { return cache[((key * 2654435761ul) >> 8) % BucketCount]; }
+
+    struct ColormapCache {
+      unsigned int screen;
       unsigned int count;
-      inline PixelRef(void)
-        : pixel(0ul), count(0u)
-      { }
-      inline PixelRef(const unsigned long x)
-        : pixel(x), count(1u)
-      { }
+      TrueColorFormat format;
+      // allocated pixels, by rgb
+      std::map<unsigned long, unsigned long> pixels;
     };
+    typedef std::map<Colormap, ColormapCache> ColormapCacheMap;
+    ColormapCacheMap colormaps;
 
-    typedef std::map<RGB,PixelRef> Cache;
-    typedef Cache::value_type CacheItem;
-    Cache cache;
+    // colors found without and with a request to the X server
+    unsigned long _hits, _misses;
   };
 
 
@@ -130,12 +164,61 @@ namespace bt {
 
 
 bt::ColorCache::ColorCache(const Display &display)
-  : _display(display)
+  : _display(display), cache_size(0u), _hits(0ul), _misses(0ul)
 { }
 
 
 bt::ColorCache::~ColorCache(void)
-{ clear(true); }
+{
+#ifdef COLORCACHE_DEBUG
+  fprintf(stderr, gettext("bt::ColorCache: %lu hits, %lu misses\n"),
+          _hits, _misses);
+#endif // COLORCACHE_DEBUG
+
+  clear(true);
+}
+
+
+const bt::ColorCache::TrueColorFormat &
+bt::ColorCache::trueColorFormat(unsigned int screen) {
+  if (formats.size() <= screen) {
+    TrueColorFormat invalid;
+    invalid.valid = false;
+    formats.resize(screen + 1, invalid);
+  }
+
+  TrueColorFormat &format = formats[screen];
+  if (!format.valid)
+    trueColorFormat(format, _display.screenInfo(screen).visual(),
+                    _display.screenInfo(screen).depth());
+  return format;
+}
+
+
+void bt::ColorCache::trueColorFormat(TrueColorFormat &format,
+                                     const Visual *visual, int depth) {
+  format.valid = false;
+  if (visual->c_class != TrueColor)
+    return;
+
+  const unsigned long masks[3] =
+    { visual->red_mask, visual->green_mask, visual->blue_mask };
+  for (unsigned int i = 0; i < 3; ++i) {
+    unsigned long mask = masks[i];
+    if (!mask)
+      return;
+    format.shift[i] = 0;
+    while (!(mask & 1)) {
+      mask >>= 1;
+      ++format.shift[i];
+    }
+    format.max[i] = mask;
+  }
+  format.alpha = 0ul;
+  if (depth >= 32)
+    format.alpha = ~(masks[0] | masks[1] | masks[2]) & 0xfffffffful;
+  format.valid = true;
+}
 
 
 unsigned long bt::ColorCache::find(unsigned int screen, int r, int g, int b) {
@@ -146,21 +229,34 @@ unsigned long bt::ColorCache::find(unsigned int screen, int r, int g, int b) {
   if (b < 0 || b > 255)
     b = 0;
 
+  const TrueColorFormat &format = trueColorFormat(screen);
+  if (format.valid) {
+    ++_hits;
+    return trueColorPixel(format, r, g, b);
+  }
+
   // see if we have allocated this color before
-  RGB rgb(screen, r, g, b);
-  Cache::iterator it = cache.find(rgb);
-  if (it != cache.end()) {
+  const unsigned long k = key(screen, r, g, b);
+  Bucket &bk = bucket(cache, k);
+  Bucket::iterator it = bk.begin(), end = bk.end();
+  for (; it != end; ++it) {
+    if (it->key != k)
+      continue;
+
     // found a cached color, use it
-    ++it->second.count;
+    ++it->count;
+    ++_hits;
 
 #ifdef COLORCACHE_DEBUG
     fprintf(stderr, gettext("bt::ColorCache: use %02x/%02x/%02x, count %4u\n"),
-            r, g, b, it->second.count);
+            r, g, b, it->count);
 #endif // COLORCACHE_DEBUG
 
-    return it->second.pixel;
+    return it->pixel;
   }
 
+  ++_misses;
+
   XColor xcol;
   xcol.red   = r | r << 8;
   xcol.green = g | g << 8;
@@ -181,7 +277,12 @@ unsigned long bt::ColorCache::find(unsigned int screen, int r, int g, int b) {
           r, g, b, xcol.pixel);
 #endif // COLORCACHE_DEBUG
 
-  cache.insert(CacheItem(rgb, PixelRef(xcol.pixel)));
+  CacheItem item;
+  item.key = k;
+  item.pixel = xcol.pixel;
+  item.count = 1u;
+  bk.push_back(item);
+  ++cache_size;
 
   return xcol.pixel;
 }
@@ -195,50 +296,63 @@ void bt::ColorCache::release(unsigned int screen, int r, int g, int b) {
   if (b < 0 || b > 255)
     b = 0;
 
-  RGB rgb(screen, r, g, b);
-  Cache::iterator it = cache.find(rgb);
+  if (trueColorFormat(screen).valid)
+    return; // never allocated
+
+  const unsigned long k = key(screen, r, g, b);
+  Bucket &bk = bucket(cache, k);
+  Bucket::iterator it = bk.begin(), end = bk.end();
+  for (; it != end && it->key != k; ++it)
+    ;
 
-  assert(it != cache.end() && it->second.count > 0);
-  --it->second.count;
+  assert(it != end && it->count > 0);
+  --it->count;
 
 #ifdef COLORCACHE_DEBUG
   fprintf(stderr, gettext("bt::ColorCache: rel %02x/%02x/%02x, count %4u\n"),
-          r, g, b, it->second.count);
+          r, g, b, it->count);
 #endif // COLORCACHE_DEBUG
 }
 
 
 void bt::ColorCache::clear(bool force) {
-  Cache::iterator it = cache.begin();
-  if (it == cache.end())
+  if (cache_size == 0u)
     return; // nothing to do
 
 #ifdef COLORCACHE_DEBUG
   fprintf(stderr, gettext("bt::ColorCache: clearing cache, %u entries\n"),
-          cache.size());
+          cache_size);
 #endif // COLORCACHE_DEBUG
 
-  unsigned long *pixels = new unsigned long[ cache.size() ];
+  unsigned long *pixels = new unsigned long[cache_size];
   unsigned int screen, count;
 
-  for (screen = 0; screen < _display.screenCount(); ++screen) {
+  // every screen that was used has a format
+  for (screen = 0; screen < formats.size(); ++screen) {
     count = 0;
-    it = cache.begin();
-    while (it != cache.end()) {
-      if (it->second.count != 0 && !force) {
-        ++it;
-        continue;
-      }
+    for (unsigned int i = 0; i < BucketCount; ++i) {
+      Bucket &bk = cache[i];
+      Bucket::iterator it = bk.begin();
+      while (it != bk.end()) {
+        if ((it->key >> 24) != screen || (it->count != 0 && !force)) {
+          ++it;
+          continue;
+        }
 
 #ifdef COLORCACHE_DEBUG
-      fprintf(stderr, gettext("bt::ColorCache: fre %02x/%02x/%02x, pixel %08lx\n"),
-              it->first.r, it->first.g, it->first.b, it->second.pixel);
+        fprintf(stderr, gettext("bt::ColorCache: fre %02x/%02x/%02x, pixel %08lx\n"),
+                static_cast<int>((it->key >> 16) & 0xff),
+                static_cast<int>((it->key >> 8) & 0xff),
+                static_cast<int>(it->key & 0xff), it->pixel);
 #endif // COLORCACHE_DEBUG
 
-      pixels[count++] = it->second.pixel;
+        pixels[count++] = it->pixel;
 
-      Cache::iterator r = it++;
-      cache.erase(r);
+        // order within a bucket does not matter
+        *it = bk.back();
+        bk.pop_back();
+        --cache_size;
+      }
     }
 
     if (count > 0u) {
@@ -252,11 +366,90 @@ void bt::ColorCache::clear(bool force) {
 
 #ifdef COLORCACHE_DEBUG
   fprintf(stderr, gettext("bt::ColorCache: cleared, %u entries remain\n"),
-          cache.size());
+          cache_size);
 #endif // COLORCACHE_DEBUG
 }
 
 
+void bt::ColorCache::addColormap(unsigned int screen, Colormap colormap,
+                                 const Visual *visual, int depth) {
+  ColormapCacheMap::iterator it = colormaps.find(colormap);
+  if (it != colormaps.end()) {
+    ++it->second.count;
+    return;
+  }
+
+  ColormapCache &cache = colormaps[colormap];
+  cache.screen = screen;
+  cache.count = 1u;
+  trueColorFormat(cache.format, visual, depth);
+}
+
+
+void bt::ColorCache::removeColormap(Colormap colormap) {
+  ColormapCacheMap::iterator it = colormaps.find(colormap);
+  assert(it != colormaps.end() && it->second.count > 0);
+  if (--it->second.count > 0)
+    return;
+
+  std::vector<unsigned long> pixels;
+  std::map<unsigned long, unsigned long>::const_iterator
+    pit = it->second.pixels.begin(), end = it->second.pixels.end();
+  for (; pit != end; ++pit)
+    pixels.push_back(pit->second);
+  if (!pixels.empty())
+    XFreeColors(_display.XDisplay(), colormap, &pixels[0], pixels.size(), 0);
+
+  colormaps.erase(it);
+}
+
+
+unsigned long bt::ColorCache::find(Colormap colormap, int r, int g, int b) {
+  if (r < 0 || r > 255)
+    r = 0;
+  if (g < 0 || g > 255)
+    g = 0;
+  if (b < 0 || b > 255)
+    b = 0;
+
+  ColormapCacheMap::iterator it = colormaps.find(colormap);
+  assert(it != colormaps.end());
+  ColormapCache &cache = it->second;
+
+  if (cache.format.valid) {
+    ++_hits;
+    return trueColorPixel(cache.format, r, g, b);
+  }
+
+  const unsigned long k = key(0u, r, g, b);
+  std::map<unsigned long, unsigned long>::const_iterator pit =
+    cache.pixels.find(k);
+  if (pit != cache.pixels.end()) {
+    ++_hits;
+    return pit->second;
+  }
+
+  ++_misses;
+
+  XColor xcol;
+  xcol.red   = r | r << 8;
+  xcol.green = g | g << 8;
+  xcol.blue  = b | b << 8;
+  xcol.pixel = 0;
+  xcol.flags = DoRed | DoGreen | DoBlue;
+
+  if (!XAllocColor(_display.XDisplay(), colormap, &xcol)) {
+    fprintf(stderr,
+            gettext("bt::Color::pixel: cannot allocate color 'rgb:%02x/%02x/%02x'\n"),
+            r, g, b);
+    return BlackPixel(_display.XDisplay(), cache.screen);
+  }
+
+  cache.pixels.insert(std::make_pair(k, xcol.pixel));
+  return xcol.pixel;
+}
+
+
 void bt::Color::clearCache(void)
 {
   if (colorcache)
@@ -304,6 +497,25 @@ unsigned long bt::Color::pixel(unsigned int screen) const {
 }
 
 
+void bt::Color::addColormap(unsigned int screen, Colormap colormap,
+                            const Visual *visual, int depth) {
+  assert(colorcache != 0);
+  colorcache->addColormap(screen, colormap, visual, depth);
+}
+
+
+void bt::Color::removeColormap(Colormap colormap) {
+  assert(colorcache != 0);
+  colorcache->removeColormap(colormap);
+}
+
+
+unsigned long bt::Color::colormapPixel(Colormap colormap) const {
+  assert(colorcache != 0);
+  return colorcache->find(colormap, _red, _green, _blue);
+}
+
+
 void bt::Color::deallocate(void) {
   if (_screen == ~0u)
     return; // not allocated
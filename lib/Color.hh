@@ -25,6 +25,8 @@
 #ifndef __Color_hh
 #define __Color_hh
 
+#include <X11/Xlib.h>
+
 #include <string>
 
 namespace bt {
@@ -52,6 +54,17 @@ namespace bt {
     static Color namedColor(const Display &display, unsigned int screen,
                             const std::string &colorname);
 
+    /*
+      Colors can also be used in colormaps other than the colormap of
+      a screen, such as the colormaps created for ARGB windows.  Each
+      user of such a colormap adds it before using colormapPixel(),
+      and removes it before freeing the colormap.  The colors used in
+      the colormap are cached until it is removed by its last user.
+    */
+    static void addColormap(unsigned int screen, Colormap colormap,
+                            const Visual *visual, int depth);
+    static void removeColormap(Colormap colormap);
+
     explicit inline Color(int r = -1, int g = -1, int b = -1)
       : _red(r), _green(g), _blue(b),
         _screen(~0u), _pixel(0ul)
@@ -73,6 +86,7 @@ namespace bt {
     { deallocate(); _red = r; _green = g; _blue = b; }
 
     unsigned long pixel(unsigned int screen) const;
+    unsigned long colormapPixel(Colormap colormap) const;
 
     inline bool valid(void) const
     { return _red != -1 && _green != -1 && _blue != -1; }
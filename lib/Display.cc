@@ -60,8 +60,14 @@ namespace bt {
 
 #ifdef    MITSHM
   void startupShm(const Display &display);
+  void shutdownShm(const Display &display);
 #endif // MITSHM
 
+
+#ifdef    RENDER_THREADS
+  void destroyRenderQueue(void);
+#endif // RENDER_THREADS
+
 } // namespace bt
 
 
@@ -104,6 +110,14 @@ bt::Display::Display(const char *dpy_name, bool multi_head) {
 
 
 bt::Display::~Display() {
+#ifdef    RENDER_THREADS
+  destroyRenderQueue();
+#endif // RENDER_THREADS
+
+#ifdef    MITSHM
+  shutdownShm(*this);
+#endif // MITSHM
+
   destroyColorTables();
   destroyPixmapCache();
   destroyPenLoader();
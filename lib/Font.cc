@@ -29,6 +29,7 @@
 #include "Pen.hh"
 #include "Resource.hh"
 
+#include <list>
 #include <map>
 #include <vector>
 
@@ -109,9 +110,78 @@ namespace bt {
     typedef std::map<FontName,FontRef> Cache;
     typedef Cache::value_type CacheItem;
     Cache cache;
+
+    /*
+      Text extents are cached for the most recently measured strings,
+      keyed by the loaded font, the screen and a hash of the string.
+      Loaded fonts are identified by their XftFont or XFontSet, so
+      the extents are forgotten whenever a font is freed.
+    */
+    bool findExtents(const void *font, unsigned int screen,
+                     const ustring &text, Rect &rect);
+    void insertExtents(const void *font, unsigned int screen,
+                       const ustring &text, const Rect &rect);
+    void clearExtents(void);
+
+    struct ExtentsKey {
+      const void *font;
+      unsigned int screen;
+      unsigned long hash;
+
+      inline bool operator<(const ExtentsKey &other) const {
+        if (hash != other.hash)
+          return hash < other.hash;
+        if (font != other.font)
+          return font < other.font;
+        return screen < other.screen;
+      }
+    };
+
+    struct ExtentsItem {
+      ExtentsKey key;
+      ustring text;
+      Rect rect;
+    };
+
+    // most recently used first
+    typedef std::list<ExtentsItem> ExtentsList;
+    ExtentsList extents;
+    typedef std::map<ExtentsKey, ExtentsList::iterator> ExtentsIndex;
+    ExtentsIndex extents_index;
+
+    unsigned long extents_hits, extents_misses;
+
+#ifdef XFT
+    /*
+      The advance of each character measured in an Xft font is
+      remembered, so that the width of any part of a string can be
+      summed without asking Xft again.  Like the extents, the advances
+      are forgotten whenever a font is freed.
+    */
+    void advanceSums(XftFont *font, const ustring &text,
+                     std::vector<int> &sums);
+
+    typedef std::map<Uchar, int> AdvanceTable;
+    typedef std::map<const XftFont *, AdvanceTable> AdvanceTables;
+    AdvanceTables advances;
+#endif
   };
 
 
+  static const unsigned int max_extents = 256u;
+
+  static unsigned long textHash(const ustring &text) {
+    // FNV-1a
+    unsigned long hash = 2166136261ul;
+    ustring::const_iterator it = text.begin(), end = text.end();
+    for (; it != end; ++it) {
+      hash ^= *it;
+      hash *= 16777619ul;
+    }
+    return hash;
+  }
+
+
   static FontCache *fontcache = 0;
 
 
@@ -173,7 +243,7 @@ namespace bt {
 
 
 bt::FontCache::FontCache(const Display &dpy)
-  : _display(dpy)
+  : _display(dpy), extents_hits(0ul), extents_misses(0ul)
 {
 #ifdef XFT
   xft_initialized = XftInit(NULL) && XftInitFtLibrary();
@@ -182,7 +252,17 @@ bt::FontCache::FontCache(const Display &dpy)
 
 
 bt::FontCache::~FontCache(void)
-{ clear(true); }
+{
+#ifdef FONTCACHE_DEBUG
+  const unsigned long lookups = extents_hits + extents_misses;
+  fprintf(stderr, gettext("bt::FontCache: extents %lu hits, %lu misses"
+                          " (%lu%%)\n"),
+          extents_hits, extents_misses,
+          lookups ? (extents_hits * 100ul) / lookups : 0ul);
+#endif // FONTCACHE_DEBUG
+
+  clear(true);
+}
 
 
 XFontSet bt::FontCache::findFontSet(const std::string &fontsetname) {
@@ -358,11 +438,93 @@ void bt::FontCache::release(const std::string &fontname, unsigned int screen) {
 }
 
 
+bool bt::FontCache::findExtents(const void *font, unsigned int screen,
+                                const ustring &text, Rect &rect) {
+  ExtentsKey key;
+  key.font = font;
+  key.screen = screen;
+  key.hash = textHash(text);
+
+  ExtentsIndex::const_iterator it = extents_index.find(key);
+  if (it == extents_index.end() || it->second->text != text) {
+    ++extents_misses;
+    return false;
+  }
+
+  ++extents_hits;
+  extents.splice(extents.begin(), extents, it->second);
+  rect = it->second->rect;
+  return true;
+}
+
+
+void bt::FontCache::insertExtents(const void *font, unsigned int screen,
+                                  const ustring &text, const Rect &rect) {
+  ExtentsItem item;
+  item.key.font = font;
+  item.key.screen = screen;
+  item.key.hash = textHash(text);
+  item.text = text;
+  item.rect = rect;
+
+  // replace a string with the same hash
+  ExtentsIndex::iterator it = extents_index.find(item.key);
+  if (it != extents_index.end()) {
+    extents.erase(it->second);
+    extents_index.erase(it);
+  }
+
+  extents.push_front(item);
+  extents_index.insert(ExtentsIndex::value_type(item.key, extents.begin()));
+
+  if (extents.size() > max_extents) {
+    extents_index.erase(extents.back().key);
+    extents.pop_back();
+  }
+}
+
+
+void bt::FontCache::clearExtents(void) {
+  extents.clear();
+  extents_index.clear();
+#ifdef XFT
+  advances.clear();
+#endif
+}
+
+
+#ifdef XFT
+/*
+  Fills 'sums' so that sums[i] is the advance of the first i
+  characters of 'text'.
+*/
+void bt::FontCache::advanceSums(XftFont *font, const ustring &text,
+                                std::vector<int> &sums) {
+  AdvanceTable &table = advances[font];
+  sums.resize(text.length() + 1);
+  sums[0] = 0;
+  for (ustring::size_type i = 0; i < text.length(); ++i) {
+    AdvanceTable::iterator it = table.find(text[i]);
+    if (it == table.end()) {
+      XGlyphInfo xgi;
+      const FcChar32 ch = text[i];
+      XftTextExtents32(_display.XDisplay(), font, &ch, 1, &xgi);
+      it = table.insert(AdvanceTable::value_type(text[i], xgi.xOff)).first;
+    }
+    sums[i + 1] = sums[i] + it->second;
+  }
+}
+#endif
+
+
 void bt::FontCache::clear(bool force) {
   Cache::iterator it = cache.begin();
   if (it == cache.end())
     return; // nothing to do
 
+  // freed fonts may be reused for other fonts
+  clearExtents();
+
 #ifdef FONTCACHE_DEBUG
   fprintf(stderr, gettext("bt::FontCache: clearing cache, %u entries\n"), cache.size());
 #endif // FONTCACHE_DEBUG
@@ -466,24 +628,36 @@ unsigned int bt::textIndent(unsigned int screen, const Font &font) {
 bt::Rect bt::textRect(unsigned int screen, const Font &font,
                       const bt::ustring &text) {
   const unsigned int indent = textIndent(screen, font);
+  Rect rect;
 
 #ifdef XFT
   XftFont * const f = font.xftFont(screen);
   if (f) {
+    if (fontcache->findExtents(f, screen, text, rect))
+      return rect;
+
     XGlyphInfo xgi;
     XftTextExtents32(fontcache->_display.XDisplay(), f,
                      reinterpret_cast<const FcChar32 *>(text.data()),
                      text.length(), &xgi);
-    return Rect(xgi.x, 0, xgi.width - xgi.x + (indent * 2),
-                f->ascent + f->descent);
+    rect.setRect(xgi.x, 0, xgi.width - xgi.x + (indent * 2),
+                 f->ascent + f->descent);
+    fontcache->insertExtents(f, screen, text, rect);
+    return rect;
   }
 #endif
 
+  const XFontSet fs = font.fontSet();
+  if (fontcache->findExtents(fs, screen, text, rect))
+    return rect;
+
   const std::string str = toLocale(text);
   XRectangle ink, unused;
-  XmbTextExtents(font.fontSet(), str.c_str(), str.length(), &ink, &unused);
-  return Rect(ink.x, 0, ink.width - ink.x + (indent * 2),
-              XExtentsOfFontSet(font.fontSet())->max_ink_extent.height);
+  XmbTextExtents(fs, str.c_str(), str.length(), &ink, &unused);
+  rect.setRect(ink.x, 0, ink.width - ink.x + (indent * 2),
+               XExtentsOfFontSet(fs)->max_ink_extent.height);
+  fontcache->insertExtents(fs, screen, text, rect);
+  return rect;
 }
 
 
@@ -564,21 +738,58 @@ bt::ustring bt::ellideText(const bt::ustring &text,
                            const bt::ustring &ellide,
                            unsigned int screen,
                            const bt::Font &font) {
-  bt::ustring visible = text;
-  bt::Rect r = bt::textRect(screen, font, visible);
-
-  if (r.width() > max_width) {
-    const int min_c = (ellide.length() * 3) - 1;
-    int c = visible.length();
-    while (--c > min_c && r.width() > max_width) {
-      visible = bt::ellideText(text, c, ellide);
-      r = bt::textRect(screen, font, visible);
+  if (bt::textRect(screen, font, text).width() <= max_width)
+    return text;
+
+  /*
+    Find the largest count whose ellided text fits.  The width only
+    shrinks with the count, so a binary search finds it.
+  */
+  const int min_c = (ellide.length() * 3) - 1;
+  int lo = min_c, hi = text.length();
+
+#ifdef XFT
+  XftFont * const f = font.xftFont(screen);
+  if (f) {
+    // sum the cached glyph advances instead of measuring each guess
+    std::vector<int> sums, ellide_sums;
+    fontcache->advanceSums(f, text, sums);
+    fontcache->advanceSums(f, ellide, ellide_sums);
+    const int len = text.length(), e = ellide.length();
+    const int extra = ellide_sums[e] + (textIndent(screen, font) * 2);
+    while (hi - lo > 1) {
+      const int c = lo + ((hi - lo) / 2);
+      const int head = (c / 2) - (e / 2), tail = (c / 2) - (e / 2) - 1;
+      const int w = sums[head] + (sums[len] - sums[len - tail]) + extra;
+      if (w <= static_cast<int>(max_width))
+        lo = c;
+      else
+        hi = c;
+    }
+
+    // advances ignore the bearings of the first and last glyphs
+    while (lo > min_c
+           && bt::textRect(screen, font,
+                           bt::ellideText(text, lo, ellide)).width()
+              > max_width)
+      --lo;
+  } else
+#endif
+  {
+    while (hi - lo > 1) {
+      const int c = lo + ((hi - lo) / 2);
+      const bt::Rect r =
+        bt::textRect(screen, font, bt::ellideText(text, c, ellide));
+      if (r.width() <= max_width)
+        lo = c;
+      else
+        hi = c;
     }
-    if (c <= min_c)
-      visible = ellide; // couldn't ellide enough
   }
 
-  return visible;
+  if (lo <= min_c)
+    return ellide; // couldn't ellide enough
+  return bt::ellideText(text, lo, ellide);
 }
 
 
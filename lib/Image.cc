@@ -27,8 +27,10 @@
 #include "Display.hh"
 #include "Pen.hh"
 #include "Texture.hh"
+#include "XDG.hh"
 
 #include <algorithm>
+#include <string>
 #include <vector>
 
 #include <X11/Xlib.h>
@@ -40,7 +42,25 @@
 #  include <unistd.h>
 #  include <X11/extensions/XShm.h>
 #endif // MITSHM
-
+#ifdef    SIMD
+#  include <immintrin.h>
+#endif // SIMD
+#ifdef    RENDER_THREADS
+#  include <sys/eventfd.h>
+#  include <pthread.h>
+#  include <signal.h>
+#  include <stdint.h>
+#  include <deque>
+#  include <map>
+#endif // RENDER_THREADS
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
 #include <math.h>
 #include <cstdio>
@@ -50,6 +70,7 @@
 
 // #define COLORTABLE_DEBUG
 // #define MITSHM_DEBUG
+// #define DISKCACHE_DEBUG
 
 
 static unsigned int right_align(unsigned int v)
@@ -71,6 +92,8 @@ static int lowest_bit(unsigned int v)
 
 unsigned int bt::Image::global_maximumColors = 0u; // automatic
 bt::DitherMode bt::Image::global_ditherMode = bt::OrderedDither;
+unsigned long bt::Image::global_diskCacheLimit = 32ul * 1024ul; // 32mb
+unsigned int bt::Image::global_renderThreads = 0u; // render immediately
 
 
 namespace bt {
@@ -95,6 +118,22 @@ namespace bt {
                         unsigned int green,
                         unsigned int blue);
 
+    /*
+      For TrueColor and DirectColor visuals, returns the pixel
+      contribution of each 8-bit channel value (0 = red, 1 = green,
+      2 = blue), with map() already applied.
+    */
+    inline bool hasPixelTables(void) const
+    { return has_pixel_tables; }
+    inline const unsigned long *pixelTable(unsigned int channel) const
+    { return pixel_tables[channel]; }
+    inline unsigned int redShift(void) const
+    { return red_shift; }
+    inline unsigned int greenShift(void) const
+    { return green_shift; }
+    inline unsigned int blueShift(void) const
+    { return blue_shift; }
+
   private:
     const Display &_dpy;
     unsigned int _screen;
@@ -103,12 +142,19 @@ namespace bt {
     int red_shift, green_shift, blue_shift;
 
     std::vector<unsigned long> colors;
+
+    bool has_pixel_tables;
+    unsigned long pixel_tables[3][256];
   };
 
 
   typedef std::vector<unsigned char> Buffer;
   static Buffer buffer;
 
+  // scratch storage for the dithering renderers
+  typedef std::vector<unsigned int> Scratch;
+  static Scratch scratch;
+
 
   typedef std::vector<XColorTable*> XColorTableList;
   static XColorTableList colorTableList;
@@ -124,15 +170,34 @@ namespace bt {
     }
     colorTableList.clear();
     buffer.clear();
+    scratch.clear();
   }
 
 
 #ifdef MITSHM
-  static XShmSegmentInfo shm_info;
+  /*
+    Shared memory segments are kept in a small pool for the lifetime
+    of the display.  Each segment is attached to the X server once,
+    when it is created, and marked busy while an XShmPutImage()
+    request is using it.  The X server tells us when it is done with
+    a segment by sending an XShmCompletionEvent, so rendering never
+    needs to wait for a round-trip unless every suitable segment is
+    in use.
+  */
+  struct ShmSegment {
+    XShmSegmentInfo info;
+    size_t size;
+    bool busy;
+  };
+
+  typedef std::vector<ShmSegment *> ShmPool;
+  static ShmPool shm_pool;
+  static size_t shm_pool_usage = 0;
+  static const size_t shm_pool_limit = 16ul * 1024ul * 1024ul; // 16mb
+  static const size_t shm_min_segment = 64ul * 1024ul; // 64kb
+
   static bool use_shm = false;
-  static bool shm_attached = false;
-  static int shm_id = -1;
-  static char *shm_addr = reinterpret_cast<char *>(-1);
+  static int shm_completion_type = -1;
 
 
   static int handleShmError(::Display *, XErrorEvent *) {
@@ -145,111 +210,486 @@ namespace bt {
     // query MIT-SHM extension
     if (!XShmQueryExtension(display.XDisplay()))
       return;
+    shm_completion_type = XShmGetEventBase(display.XDisplay()) + ShmCompletion;
     use_shm = true;
   }
 
 
-  void destroyShmImage(const Display &display, XImage *image) {
-    // tell the X server to detach
-    if (shm_attached) {
-      XShmDetach(display.XDisplay(), &shm_info);
+  static void destroyShmSegment(ShmSegment *segment) {
+    // the segment was marked for removal when it was created, so this
+    // is all that is needed to free it
+    if (segment->info.shmaddr != reinterpret_cast<char *>(-1))
+      shmdt(segment->info.shmaddr);
 
-      // wait for the server to render the image and detach the memory
-      // segment
-      XSync(display.XDisplay(), False);
+    assert(segment->size <= shm_pool_usage);
+    shm_pool_usage -= segment->size;
+    delete segment;
+  }
 
-      shm_attached = false;
-    }
 
-    // detach shared memory segment
-    if (shm_addr != reinterpret_cast<char *>(-1))
-      shmdt(shm_addr);
-    shm_addr = reinterpret_cast<char *>(-1);
+  void shutdownShm(const Display &display) {
+    if (shm_pool.empty())
+      return;
 
-    // destroy shared memory id
-    if (shm_id != -1)
-      shmctl(shm_id, IPC_RMID, 0);
-    shm_id = -1;
+    // tell the X server to detach all segments, then detach them
+    // ourselves
+    ShmPool::iterator it = shm_pool.begin(), end = shm_pool.end();
+    for (; it != end; ++it)
+      XShmDetach(display.XDisplay(), &(*it)->info);
+    XSync(display.XDisplay(), False);
 
-    // destroy XImage
-    image->data = 0;
-    XDestroyImage(image);
+    for (it = shm_pool.begin(); it != end; ++it)
+      destroyShmSegment(*it);
+    shm_pool.clear();
   }
 
 
-  XImage *createShmImage(const Display &display, const ScreenInfo &screeninfo,
-                         unsigned int width, unsigned int height) {
-    if (!use_shm)
-      return 0;
+  bool processShmCompletion(const XEvent * const event) {
+    if (shm_completion_type == -1 || event->type != shm_completion_type)
+      return false;
 
-    // use MIT-SHM extension
-    XImage *image = XShmCreateImage(display.XDisplay(), screeninfo.visual(),
-                                    screeninfo.depth(), ZPixmap, 0,
-                                    &shm_info, width, height);
-    if (!image)
-      return 0;
+    const XShmCompletionEvent * const e =
+      reinterpret_cast<const XShmCompletionEvent *>(event);
+    ShmPool::iterator it = shm_pool.begin(), end = shm_pool.end();
+    for (; it != end; ++it) {
+      if ((*it)->info.shmseg == e->shmseg) {
+        (*it)->busy = false;
+        break;
+      }
+    }
+    return true;
+  }
+
+
+  static Bool isShmCompletion(::Display *, XEvent *event, XPointer arg) {
+    if (event->type != shm_completion_type)
+      return False;
+    const ShmSegment * const segment =
+      reinterpret_cast<const ShmSegment *>(arg);
+    return (reinterpret_cast<const XShmCompletionEvent *>(event)->shmseg
+            == segment->info.shmseg);
+  }
+
+
+  static ShmSegment *createShmSegment(const Display &display, size_t size) {
+    ShmSegment *segment = new ShmSegment;
+    segment->size = size;
+    segment->busy = false;
+    segment->info.shmaddr = reinterpret_cast<char *>(-1);
+    segment->info.readOnly = True;
 
     // get shared memory id
-    unsigned int usage = image->bytes_per_line * image->height;
-    shm_id = shmget(IPC_PRIVATE, usage, IPC_CREAT | 0644);
-    if (shm_id == -1) {
+    segment->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (segment->info.shmid == -1) {
 #ifdef MITSHM_DEBUG
-      perror("bt::createShmImage: shmget");
+      perror("bt::createShmSegment: shmget");
 #endif // MITSHM_DEBUG
 
       use_shm = false;
-      XDestroyImage(image);
+      delete segment;
       return 0;
     }
 
-    // attached shared memory segment
-    shm_addr = static_cast<char *>(shmat(shm_id, 0, 0));
-    if (shm_addr == reinterpret_cast<char *>(-1)) {
+    // attach shared memory segment
+    segment->info.shmaddr =
+      static_cast<char *>(shmat(segment->info.shmid, 0, 0));
+    if (segment->info.shmaddr == reinterpret_cast<char *>(-1)) {
 #ifdef MITSHM_DEBUG
-      perror("bt::createShmImage: shmat");
+      perror("bt::createShmSegment: shmat");
 #endif // MITSHM_DEBUG
 
       use_shm = false;
-      destroyShmImage(display, image);
+      shmctl(segment->info.shmid, IPC_RMID, 0);
+      delete segment;
       return 0;
     }
 
-    // tell the X server to attach
-    shm_info.shmid = shm_id;
-    shm_info.shmaddr = shm_addr;
-    shm_info.readOnly = True;
+    // tell the X server to attach.  this happens only once per
+    // segment, so we can afford to wait for the server here.
+    XErrorHandler old_handler = XSetErrorHandler(handleShmError);
+    XShmAttach(display.XDisplay(), &segment->info);
+    XSync(display.XDisplay(), False);
+    XSetErrorHandler(old_handler);
+
+    // both sides are attached now, so mark the segment for removal.
+    // it will be freed automatically once both sides detach, even if
+    // we exit abnormally.
+    shmctl(segment->info.shmid, IPC_RMID, 0);
+
+    if (!use_shm) {
+      // the X server failed to attach the shm segment
 
-    static bool test_server_attach = true;
-    if (test_server_attach) {
-      // never checked if the X server can do shared memory...
-      XErrorHandler old_handler = XSetErrorHandler(handleShmError);
-      XShmAttach(display.XDisplay(), &shm_info);
-      XSync(display.XDisplay(), False);
-      XSetErrorHandler(old_handler);
+#ifdef MITSHM_DEBUG
+      fprintf(stderr, gettext("bt::createShmSegment: X server failed to attach\n"));
+#endif // MITSHM_DEBUG
+
+      shmdt(segment->info.shmaddr);
+      delete segment;
+      return 0;
+    }
 
-      if (!use_shm) {
-        // the X server failed to attach the shm segment
+    shm_pool_usage += size;
+    shm_pool.push_back(segment);
 
 #ifdef MITSHM_DEBUG
-        fprintf(stderr, gettext("bt::createShmImage: X server failed to attach\n"));
+    fprintf(stderr, gettext("bt::createShmSegment: add %8lu bytes, "
+                            "pool %8lu bytes\n"),
+            static_cast<unsigned long>(size),
+            static_cast<unsigned long>(shm_pool_usage));
 #endif // MITSHM_DEBUG
 
-        destroyShmImage(display, image);
-        return 0;
+    return segment;
+  }
+
+
+  static ShmSegment *findShmSegment(const Display &display, size_t usage) {
+    // segments are allocated in power-of-two sized buckets, so that
+    // the many slightly different sizes we render can share segments
+    size_t size = shm_min_segment;
+    while (size < usage)
+      size <<= 1;
+    if (size > shm_pool_limit)
+      return 0; // too big, use a normal XImage instead
+
+    // pick up any completion events that are already queued
+    XEvent event;
+    while (XCheckTypedEvent(display.XDisplay(), shm_completion_type, &event))
+      processShmCompletion(&event);
+
+    // use the smallest free segment that is big enough
+    ShmSegment *best = 0, *wait = 0;
+    ShmPool::iterator it = shm_pool.begin(), end = shm_pool.end();
+    for (; it != end; ++it) {
+      ShmSegment * const segment = *it;
+      if (segment->size < size)
+        continue;
+      if (segment->busy) {
+        if (!wait || segment->size < wait->size)
+          wait = segment;
+      } else if (!best || segment->size < best->size) {
+        best = segment;
+      }
+    }
+    if (best)
+      return best;
+
+    // make room for a new segment by throwing away free segments that
+    // are too small
+    for (it = shm_pool.begin(); it != shm_pool.end()
+           && shm_pool_usage + size > shm_pool_limit; ) {
+      if ((*it)->busy || (*it)->size >= size) {
+        ++it;
+        continue;
       }
+      XShmDetach(display.XDisplay(), &(*it)->info);
+      destroyShmSegment(*it);
+      it = shm_pool.erase(it);
+    }
 
-      test_server_attach = false;
-    } else {
-      // we know the X server can attach to the memory segment
-      XShmAttach(display.XDisplay(), &shm_info);
+    if (shm_pool_usage + size <= shm_pool_limit)
+      return createShmSegment(display, size);
+
+    if (!wait)
+      return 0; // the pool is full of busy segments that are too small
+
+    // wait for the X server to finish with a busy segment
+    XIfEvent(display.XDisplay(), &event, isShmCompletion,
+             reinterpret_cast<XPointer>(wait));
+    processShmCompletion(&event);
+    return wait;
+  }
+
+
+  XImage *createShmImage(const Display &display, const ScreenInfo &screeninfo,
+                         unsigned int width, unsigned int height) {
+    if (!use_shm)
+      return 0;
+
+    // use MIT-SHM extension
+    XImage *image = XShmCreateImage(display.XDisplay(), screeninfo.visual(),
+                                    screeninfo.depth(), ZPixmap, 0,
+                                    0, width, height);
+    if (!image)
+      return 0;
+
+    const size_t usage = image->bytes_per_line * image->height;
+    ShmSegment *segment = findShmSegment(display, usage);
+    if (!segment) {
+      XDestroyImage(image);
+      return 0;
     }
 
-    shm_attached = true;
-    image->data = shm_addr;
+    image->data = segment->info.shmaddr;
+    image->obdata = reinterpret_cast<char *>(&segment->info);
     return image;
   }
+
+
+  void putShmImage(const Display &display, Drawable drawable, GC gc,
+                   XImage *image) {
+    // the completion event tells us when the segment can be reused
+    XShmPutImage(display.XDisplay(), drawable, gc, image,
+                 0, 0, 0, 0, image->width, image->height, True);
+
+    const XShmSegmentInfo * const info =
+      reinterpret_cast<const XShmSegmentInfo *>(image->obdata);
+    ShmPool::iterator it = shm_pool.begin(), end = shm_pool.end();
+    for (; it != end; ++it) {
+      if (&(*it)->info == info) {
+        (*it)->busy = true;
+        break;
+      }
+    }
+
+    // the segment belongs to the pool, not to the image
+    image->data = 0;
+    image->obdata = 0;
+    XDestroyImage(image);
+  }
 #endif // MITSHM
 
+
+  /*
+    Large rendered images are also kept on disk, one file per image
+    in $XDG_CACHE_HOME/blackbox/textures, so that restarting blackbox
+    or reloading a style does not render them again.  Each file starts
+    with a header that describes the texture in full (the file name is
+    only a hash) and the layout of RGB on this machine; files with a
+    different version or layout are ignored and replaced.  When the
+    files use more than the disk cache limit, the least recently used
+    ones are removed.
+  */
+  static const char disk_cache_dir[] = "blackbox/textures/";
+  static const unsigned int disk_cache_version = 1u;
+  // images smaller than this are faster to render than to read
+  static const unsigned long disk_cache_min_pixels = 16384ul;
+  static unsigned long disk_cache_usage = 0ul;
+  static bool disk_cache_scanned = false;
+
+  struct DiskCacheHeader {
+    char magic[4];
+    unsigned int version;
+    unsigned int layout;
+    unsigned int width, height;
+    unsigned int texture;
+    unsigned int border_width;
+    int colors[5][3];
+  };
+
+  static void diskCacheHeader(DiskCacheHeader &header,
+                              const Texture &texture,
+                              unsigned int width, unsigned int height) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "bbtx", sizeof(header.magic));
+    header.version = disk_cache_version;
+
+    const RGB rgb = { 0x11, 0x22, 0x33, 0x44 };
+    memcpy(&header.layout, &rgb, std::min(sizeof(rgb),
+                                          sizeof(header.layout)));
+
+    header.width = width;
+    header.height = height;
+    header.texture = texture.texture();
+    header.border_width = texture.borderWidth();
+
+    const Color * const colors[5] = {
+      &texture.color1(), &texture.color2(), &texture.borderColor(),
+      &texture.lightColor(), &texture.shadowColor()
+    };
+    for (unsigned int i = 0; i < 5; ++i) {
+      header.colors[i][0] = colors[i]->red();
+      header.colors[i][1] = colors[i]->green();
+      header.colors[i][2] = colors[i]->blue();
+    }
+  }
+
+  static bool useDiskCache(unsigned int width, unsigned int height) {
+    const unsigned long pixels =
+      static_cast<unsigned long>(width) * height;
+    // a single image may not use more than 1/8 of the disk cache
+    return (Image::diskCacheLimit() > 0
+            && pixels >= disk_cache_min_pixels
+            && (pixels * sizeof(RGB)) / 1024 <= Image::diskCacheLimit() / 8);
+  }
+
+  static std::string diskCacheFile(const Texture &texture,
+                                   unsigned int width, unsigned int height) {
+    char name[64];
+    sprintf(name, "%016lx-%ux%u", textureHash(texture), width, height);
+    return std::string(disk_cache_dir) + name;
+  }
+
+  static bool readDiskCache(const Texture &texture,
+                            unsigned int width, unsigned int height,
+                            RGB *data) {
+    const std::string path =
+      XDG::BaseDir::cacheHome() + diskCacheFile(texture, width, height);
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+
+    const size_t size =
+      sizeof(DiskCacheHeader) + (width * height * sizeof(RGB));
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size)
+      map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      return false;
+
+    DiskCacheHeader header;
+    diskCacheHeader(header, texture, width, height);
+    const bool found = memcmp(map, &header, sizeof(header)) == 0;
+    if (found) {
+      memcpy(data, static_cast<const char *>(map) + sizeof(header),
+             width * height * sizeof(RGB));
+    }
+    munmap(map, size);
+
+    if (found) {
+      // mark as recently used
+      utimes(path.c_str(), 0);
+    }
+
+#ifdef DISKCACHE_DEBUG
+    fprintf(stderr, gettext("bt::Image: disk cache %s %s\n"),
+            found ? "hit " : "stale", path.c_str());
+#endif // DISKCACHE_DEBUG
+
+    return found;
+  }
+
+  struct DiskCacheEntry {
+    std::string path;
+    time_t mtime;
+    unsigned long size;
+
+    inline bool operator<(const DiskCacheEntry &other) const
+    { return mtime < other.mtime; }
+  };
+
+  /*
+    Recounts the disk cache usage and, if it is over the limit, removes
+    the least recently used files until it is down to 3/4 of the limit.
+  */
+  static void trimDiskCache(void) {
+    const std::string directory = XDG::BaseDir::cacheHome() + disk_cache_dir;
+    DIR *dir = opendir(directory.c_str());
+    if (!dir)
+      return;
+
+    std::vector<DiskCacheEntry> entries;
+    disk_cache_usage = 0ul;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != 0) {
+      if (dirent->d_name[0] == '.')
+        continue;
+
+      DiskCacheEntry entry;
+      entry.path = directory + dirent->d_name;
+      struct stat st;
+      if (stat(entry.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        continue;
+      entry.mtime = st.st_mtime;
+      entry.size = st.st_size;
+      entries.push_back(entry);
+      disk_cache_usage += entry.size;
+    }
+    closedir(dir);
+    disk_cache_scanned = true;
+
+    const unsigned long limit = Image::diskCacheLimit() * 1024ul;
+    if (disk_cache_usage <= limit)
+      return;
+
+    std::sort(entries.begin(), entries.end());
+    const unsigned long low_water = limit - (limit / 4);
+    std::vector<DiskCacheEntry>::const_iterator it = entries.begin();
+    for (; it != entries.end() && disk_cache_usage > low_water; ++it) {
+      if (unlink(it->path.c_str()) == 0)
+        disk_cache_usage -= it->size;
+    }
+  }
+
+  static void writeDiskCache(const Texture &texture,
+                             unsigned int width, unsigned int height,
+                             const RGB *data) {
+    const std::string path =
+      XDG::BaseDir::writeCacheFile(diskCacheFile(texture, width, height));
+    if (path.empty())
+      return;
+
+    // write to a temporary file, so that readers never see a partial
+    // image
+    char suffix[32];
+    sprintf(suffix, ".%ld", static_cast<long>(getpid()));
+    const std::string tmp = path + suffix;
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+      return;
+
+    DiskCacheHeader header;
+    diskCacheHeader(header, texture, width, height);
+    const size_t size = width * height * sizeof(RGB);
+    const bool ok =
+      (write(fd, &header, sizeof(header))
+       == static_cast<ssize_t>(sizeof(header))
+       && write(fd, data, size) == static_cast<ssize_t>(size));
+    if (close(fd) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+      unlink(tmp.c_str());
+      return;
+    }
+
+#ifdef DISKCACHE_DEBUG
+    fprintf(stderr, gettext("bt::Image: disk cache add  %s\n"), path.c_str());
+#endif // DISKCACHE_DEBUG
+
+    disk_cache_usage += sizeof(header) + size;
+    if (!disk_cache_scanned
+        || disk_cache_usage > Image::diskCacheLimit() * 1024ul)
+      trimDiskCache();
+  }
+
+
+  // get the colortable for the screen. if necessary, we will create one.
+  static XColorTable *colorTable(const Display &display, unsigned int screen) {
+    if (colorTableList.empty())
+      colorTableList.resize(display.screenCount(), 0);
+
+    if (!colorTableList[screen])
+      colorTableList[screen] =
+        new XColorTable(display, screen, Image::maximumColors());
+    return colorTableList[screen];
+  }
+
+
+  static void drawBorder(unsigned int screen, const Texture &texture,
+                         Pixmap pixmap,
+                         unsigned int width, unsigned int height) {
+    if (!(texture.texture() & bt::Texture::Border))
+      return;
+
+    Pen penborder(screen, texture.borderColor());
+    const unsigned int bw = texture.borderWidth();
+    for (unsigned int i = 0; i < bw; ++i) {
+      XDrawRectangle(penborder.XDisplay(), pixmap, penborder.gc(),
+                     i, i, width - (i * 2) - 1, height - (i * 2) - 1);
+    }
+  }
+
+
+#ifdef    RENDER_THREADS
+  // smaller images are faster to render than to hand to a worker
+  static const unsigned long render_queue_min_pixels = 16384ul;
+
+  static bool useRenderQueue(unsigned int width, unsigned int height) {
+    return (Image::renderThreads() > 0
+            && (static_cast<unsigned long>(width) * height
+                >= render_queue_min_pixels));
+  }
+#endif // RENDER_THREADS
+
 } // namespace bt
 
 
@@ -257,7 +697,8 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
                              unsigned int maxColors)
   : _dpy(dpy), _screen(screen),
     n_red(0u), n_green(0u), n_blue(0u),
-    red_shift(0u), green_shift(0u), blue_shift(0u)
+    red_shift(0u), green_shift(0u), blue_shift(0u),
+    has_pixel_tables(false)
 {
   const ScreenInfo &screeninfo = _dpy.screenInfo(_screen);
   const Visual * const visual = screeninfo.visual();
@@ -409,6 +850,17 @@ bt::XColorTable::XColorTable(const Display &dpy, unsigned int screen,
     break;
   } // switch
 
+  if (visual_class == TrueColor || visual_class == DirectColor) {
+    for (unsigned int c = 0; c < 256u; ++c) {
+      unsigned int r = c, g = c, b = c;
+      map(r, g, b);
+      pixel_tables[0][c] = pixel(r, 0u, 0u);
+      pixel_tables[1][c] = pixel(0u, g, 0u);
+      pixel_tables[2][c] = pixel(0u, 0u, b);
+    }
+    has_pixel_tables = true;
+  }
+
 #ifdef COLORTABLE_DEBUG
   switch (visual_class) {
   case StaticGray:
@@ -587,7 +1039,7 @@ bt::Image::~Image(void) {
 
 
 Pixmap bt::Image::render(const Display &display, unsigned int screen,
-                         const bt::Texture &texture) {
+                         const bt::Texture &texture, bool deferred) {
   if (texture.texture() & bt::Texture::Parent_Relative)
     return ParentRelative;
   if (texture.texture() & bt::Texture::Solid)
@@ -595,11 +1047,35 @@ Pixmap bt::Image::render(const Display &display, unsigned int screen,
   if (!(texture.texture() & bt::Texture::Gradient))
     return None;
 
-  const Color from = texture.color1(), to = texture.color2();
-  const bool interlaced = texture.texture() & bt::Texture::Interlaced;
+#ifdef    RENDER_THREADS
+  if (deferred && useRenderQueue(width, height))
+    return renderDeferred(display, screen, texture);
+#else
+  (void) deferred;
+#endif // RENDER_THREADS
 
   data = new RGB[width * height];
 
+  const bool disk_cache = useDiskCache(width, height);
+  if (!disk_cache || !readDiskCache(texture, width, height, data)) {
+    renderTexture(texture);
+
+    if (disk_cache)
+      writeDiskCache(texture, width, height, data);
+  }
+
+  Pixmap pixmap = renderPixmap(display, screen);
+  if (pixmap)
+    drawBorder(screen, texture, pixmap, width, height);
+
+  return pixmap;
+}
+
+
+void bt::Image::renderTexture(const bt::Texture &texture) {
+  const Color from = texture.color1(), to = texture.color2();
+  const bool interlaced = texture.texture() & bt::Texture::Interlaced;
+
   if (texture.texture() & bt::Texture::Diagonal)
     dgradient(from, to, interlaced);
   else if (texture.texture() & bt::Texture::Elliptic)
@@ -623,21 +1099,6 @@ Pixmap bt::Image::render(const Display &display, unsigned int screen,
     raisedBevel(texture.borderWidth());
   else if (texture.texture() & bt::Texture::Sunken)
     sunkenBevel(texture.borderWidth());
-
-  Pixmap pixmap = renderPixmap(display, screen);
-
-  unsigned int bw = 0;
-  if (texture.texture() & bt::Texture::Border) {
-    Pen penborder(screen, texture.borderColor());
-    bw = texture.borderWidth();
-
-    for (unsigned int i = 0; i < bw; ++i) {
-      XDrawRectangle(penborder.XDisplay(), pixmap, penborder.gc(),
-                     i, i, width - (i * 2) - 1, height - (i * 2) - 1);
-    }
-  }
-
-  return pixmap;
 }
 
 
@@ -681,104 +1142,371 @@ static const unsigned int dither16[16][16] = {
 
 
 /*
- * Helper function for TrueColorDither and renderXImage
+ * Helper function for the image renderers below
  *
  * This handles the proper setting of the image data based on the image depth
- * and the machine's byte ordering
+ * and the machine's byte ordering.  The template argument is the number of
+ * bits per pixel, plus one for MSBFirst byte order.
  */
-static void assignPixelData(unsigned int bit_depth, unsigned char **data,
-                            unsigned long pixel) {
-  unsigned char *pixel_data = *data;
-  switch (bit_depth) {
-  case  8: //  8bpp
-    pixel_data[0] = pixel;
-    ++pixel_data;
-    break;
+template <unsigned int _Format>
+static inline void assignPixelData(unsigned char *&pixel_data,
+                                   unsigned long pixel);
+
+template <>
+inline void assignPixelData<8>(unsigned char *&pixel_data,
+                               unsigned long pixel) { //  8bpp
+  pixel_data[0] = pixel;
+  ++pixel_data;
+}
 
-  case 16: // 16bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data += 2;
-    break;
+template <>
+inline void assignPixelData<16>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 16bpp LSB
+  pixel_data[0] = pixel;
+  pixel_data[1] = pixel >> 8;
+  pixel_data += 2;
+}
 
-  case 17: // 16bpp MSB
-    pixel_data[0] = pixel >> 8;
-    pixel_data[1] = pixel;
-    pixel_data += 2;
-    break;
+template <>
+inline void assignPixelData<17>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 16bpp MSB
+  pixel_data[0] = pixel >> 8;
+  pixel_data[1] = pixel;
+  pixel_data += 2;
+}
 
-  case 24: // 24bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel >> 16;
-    pixel_data += 3;
-    break;
+template <>
+inline void assignPixelData<24>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 24bpp LSB
+  pixel_data[0] = pixel;
+  pixel_data[1] = pixel >> 8;
+  pixel_data[2] = pixel >> 16;
+  pixel_data += 3;
+}
 
-  case 25: // 24bpp MSB
-    pixel_data[0] = pixel >> 16;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel;
-    pixel_data += 3;
-    break;
+template <>
+inline void assignPixelData<25>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 24bpp MSB
+  pixel_data[0] = pixel >> 16;
+  pixel_data[1] = pixel >> 8;
+  pixel_data[2] = pixel;
+  pixel_data += 3;
+}
 
-  case 32: // 32bpp LSB
-    pixel_data[0] = pixel;
-    pixel_data[1] = pixel >> 8;
-    pixel_data[2] = pixel >> 16;
-    pixel_data[3] = pixel >> 24;
-    pixel_data += 4;
-    break;
+template <>
+inline void assignPixelData<32>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 32bpp LSB
+  pixel_data[0] = pixel;
+  pixel_data[1] = pixel >> 8;
+  pixel_data[2] = pixel >> 16;
+  pixel_data[3] = pixel >> 24;
+  pixel_data += 4;
+}
 
-  case 33: // 32bpp MSB
-    pixel_data[0] = pixel >> 24;
-    pixel_data[1] = pixel >> 16;
-    pixel_data[2] = pixel >> 8;
-    pixel_data[3] = pixel;
-    pixel_data += 4;
-    break;
+template <>
+inline void assignPixelData<33>(unsigned char *&pixel_data,
+                                unsigned long pixel) { // 32bpp MSB
+  pixel_data[0] = pixel >> 24;
+  pixel_data[1] = pixel >> 16;
+  pixel_data[2] = pixel >> 8;
+  pixel_data[3] = pixel;
+  pixel_data += 4;
+}
+
+
+/*
+ * Calls renderer.render<format>() for the pixel format of the image, so
+ * that the format is chosen once per image instead of once per pixel.
+ * Unsupported formats are left untouched.
+ */
+template <typename _Renderer>
+static void renderPixelData(unsigned int format, const _Renderer &renderer) {
+  switch (format) {
+  case  8: renderer.template render< 8>(); break;
+  case 16: renderer.template render<16>(); break;
+  case 17: renderer.template render<17>(); break;
+  case 24: renderer.template render<24>(); break;
+  case 25: renderer.template render<25>(); break;
+  case 32: renderer.template render<32>(); break;
+  case 33: renderer.template render<33>(); break;
+  default: break;
   }
-  *data = pixel_data; // assign back so we don't lose our place
 }
 
 
-// algorithm: ordered dithering... many many thanks to rasterman
-// (raster@rasterman.com) for telling me about this... portions of this
-// code is based off of his code in Imlib
-void bt::Image::OrderedDither(XColorTable *colortable,
-                              unsigned int bit_depth,
-                              unsigned int bytes_per_line,
-                              unsigned char *pixel_data) {
-  unsigned int x, y, dithx, dithy, r, g, b, error, offset;
-  unsigned char *ppixel_data = pixel_data;
+namespace bt {
 
-  unsigned int maxr = 255, maxg = 255, maxb = 255;
-  colortable->map(maxr, maxg, maxb);
+  /*
+    Ordered dithering computes each channel of a pixel as
 
-  for (y = 0, offset = 0; y < height; ++y) {
-    dithy = y & 15;
+      (scale * value + dither16[y & 15][x & 15]) >> 16
+
+    and packs the three channels into one word using the given
+    shifts.  For TrueColor and DirectColor visuals these are the
+    shifts of the visual, so the word is the pixel value itself.
+
+    orderedDitherRow() is the reference implementation.  When
+    available, an SSE2 version is selected at runtime; it produces
+    exactly the same output.
+  */
+  struct OrderedDitherRow {
+    const unsigned int *error;
+    unsigned int scale[3];
+    unsigned int shift[3];
+  };
+
+  typedef void (*OrderedDitherKernel)(const OrderedDitherRow &row,
+                                      const RGB *p, unsigned int *pixels,
+                                      unsigned int width);
+
+  static void orderedDitherRow(const OrderedDitherRow &row, const RGB *p,
+                               unsigned int *pixels,
+                               unsigned int begin, unsigned int end) {
+    for (unsigned int x = begin; x < end; ++x) {
+      const unsigned int error = row.error[x & 15];
+      pixels[x] = ((((row.scale[0] * p[x].red   + error) >> 16)
+                    << row.shift[0])
+                   | (((row.scale[1] * p[x].green + error) >> 16)
+                      << row.shift[1])
+                   | (((row.scale[2] * p[x].blue  + error) >> 16)
+                      << row.shift[2]));
+    }
+  }
 
-    for (x = 0; x < width; ++x, ++offset) {
-      dithx = x & 15;
+  static void orderedDitherRow(const OrderedDitherRow &row, const RGB *p,
+                               unsigned int *pixels, unsigned int width)
+  { orderedDitherRow(row, p, pixels, 0, width); }
+
+#ifdef    SIMD
+  static bool packedRGB(void) {
+    const RGB rgb = { 0x11, 0x22, 0x33, 0x44 };
+    unsigned int word;
+    if (sizeof(rgb) != sizeof(word))
+      return false;
+    memcpy(&word, &rgb, sizeof(word));
+    return word == 0x44332211u;
+  }
 
-      error = dither16[dithy][dithx];
+#  ifdef  __SSE2__
+  /*
+    Computes 8 pixels at a time.  SSE2 has no 32-bit multiply, so the
+    products are formed from 16-bit halves; scale can be 65536, so
+    value * scale is computed as value * (scale - 1) + value.
+  */
+  static void orderedDitherRowSSE2(const OrderedDitherRow &row,
+                                   const RGB *p, unsigned int *pixels,
+                                   unsigned int width) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i scale[3], shift[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+      scale[i] = _mm_set1_epi16(static_cast<short>(row.scale[i] - 1));
+      shift[i] = _mm_cvtsi32_si128(row.shift[i]);
+    }
 
-      r = (((256 * maxr + maxr + 1) * data[offset].red   + error) / 65536);
-      g = (((256 * maxg + maxg + 1) * data[offset].green + error) / 65536);
-      b = (((256 * maxb + maxb + 1) * data[offset].blue  + error) / 65536);
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      const __m128i *s = reinterpret_cast<const __m128i *>(p + x);
+      const __m128i *e =
+        reinterpret_cast<const __m128i *>(row.error + (x & 15));
+      const __m128i s0 = _mm_loadu_si128(s), s1 = _mm_loadu_si128(s + 1);
+      const __m128i e0 = _mm_loadu_si128(e), e1 = _mm_loadu_si128(e + 1);
+      __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+      for (unsigned int i = 0; i < 3; ++i) {
+        const __m128i c0 = _mm_and_si128(_mm_srli_epi32(s0, i * 8), mask);
+        const __m128i c1 = _mm_and_si128(_mm_srli_epi32(s1, i * 8), mask);
+        const __m128i c = _mm_packs_epi32(c0, c1);
+        const __m128i ml = _mm_mullo_epi16(c, scale[i]);
+        const __m128i mh = _mm_mulhi_epu16(c, scale[i]);
+        const __m128i v0 =
+          _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi16(ml, mh), c0), e0);
+        const __m128i v1 =
+          _mm_add_epi32(_mm_add_epi32(_mm_unpackhi_epi16(ml, mh), c1), e1);
+        lo = _mm_or_si128(lo, _mm_sll_epi32(_mm_srli_epi32(v0, 16), shift[i]));
+        hi = _mm_or_si128(hi, _mm_sll_epi32(_mm_srli_epi32(v1, 16), shift[i]));
+      }
 
-      assignPixelData(bit_depth, &pixel_data, colortable->pixel(r, g, b));
+      __m128i *d = reinterpret_cast<__m128i *>(pixels + x);
+      _mm_storeu_si128(d,     lo);
+      _mm_storeu_si128(d + 1, hi);
     }
 
-    pixel_data = (ppixel_data += bytes_per_line);
+    orderedDitherRow(row, p, pixels, x, width);
+  }
+#  endif // __SSE2__
+#endif // SIMD
+
+  static OrderedDitherKernel orderedDitherKernel(void) {
+    static OrderedDitherKernel kernel = 0;
+    if (!kernel) {
+      kernel = orderedDitherRow;
+#if defined(SIMD) && defined(__SSE2__)
+      if (packedRGB())
+        kernel = orderedDitherRowSSE2;
+#endif // SIMD && __SSE2__
+    }
+    return kernel;
+  }
+
+  struct PixelRenderer {
+    const RGB * const data;
+    const unsigned int width, height;
+    XColorTable * const colortable;
+    const unsigned int bytes_per_line;
+    unsigned char * const image_data;
+
+    inline PixelRenderer(const RGB *d, unsigned int w, unsigned int h,
+                         XColorTable *c, unsigned int bpl, unsigned char *p)
+      : data(d), width(w), height(h), colortable(c),
+        bytes_per_line(bpl), image_data(p)
+    { }
+  };
+
+  /*
+    TrueColor and DirectColor visuals without dithering: each pixel
+    is the combination of three table lookups.
+  */
+  struct TrueColorRenderer : public PixelRenderer {
+    inline TrueColorRenderer(const RGB *d, unsigned int w, unsigned int h,
+                             XColorTable *c, unsigned int bpl,
+                             unsigned char *p)
+      : PixelRenderer(d, w, h, c, bpl, p)
+    { }
+
+    template <unsigned int _Format>
+    void render(void) const {
+      const unsigned long * const red_table = colortable->pixelTable(0);
+      const unsigned long * const green_table = colortable->pixelTable(1);
+      const unsigned long * const blue_table = colortable->pixelTable(2);
+      const RGB *rgb = data;
+      unsigned char *ppixel_data = image_data;
+
+      for (unsigned int y = 0; y < height; ++y) {
+        unsigned char *p = ppixel_data;
+        for (unsigned int x = 0; x < width; ++x, ++rgb)
+          assignPixelData<_Format>(p, red_table[rgb->red]
+                                      | green_table[rgb->green]
+                                      | blue_table[rgb->blue]);
+        ppixel_data += bytes_per_line;
+      }
+    }
+  };
+
+  /*
+    All other visuals without dithering.
+  */
+  struct ColorTableRenderer : public PixelRenderer {
+    inline ColorTableRenderer(const RGB *d, unsigned int w, unsigned int h,
+                              XColorTable *c, unsigned int bpl,
+                              unsigned char *p)
+      : PixelRenderer(d, w, h, c, bpl, p)
+    { }
+
+    template <unsigned int _Format>
+    void render(void) const {
+      unsigned int x, y, offset, r, g, b;
+      unsigned char *pixel_data = image_data,
+                   *ppixel_data = image_data;
+
+      for (y = 0, offset = 0; y < height; ++y) {
+        for (x = 0; x < width; ++x, ++offset) {
+          r = data[offset].red;
+          g = data[offset].green;
+          b = data[offset].blue;
+
+          colortable->map(r, g, b);
+          assignPixelData<_Format>(pixel_data, colortable->pixel(r, g, b));
+        }
+
+        pixel_data = (ppixel_data += bytes_per_line);
+      }
+    }
+  };
+
+  // algorithm: ordered dithering... many many thanks to rasterman
+  // (raster@rasterman.com) for telling me about this... portions of this
+  // code is based off of his code in Imlib
+  struct OrderedDitherRenderer : public PixelRenderer {
+    // a row of pixel values
+    unsigned int * const scratch;
+
+    inline OrderedDitherRenderer(const RGB *d, unsigned int w,
+                                 unsigned int h, XColorTable *c,
+                                 unsigned int bpl, unsigned char *p,
+                                 unsigned int *s)
+      : PixelRenderer(d, w, h, c, bpl, p), scratch(s)
+    { }
+
+    template <unsigned int _Format>
+    void render(void) const;
+  };
+
+  struct FloydSteinbergDitherRenderer : public PixelRenderer {
+    // 6 error rows followed by a row of pixel values
+    unsigned int * const scratch;
+
+    inline FloydSteinbergDitherRenderer(const RGB *d, unsigned int w,
+                                        unsigned int h, XColorTable *c,
+                                        unsigned int bpl, unsigned char *p,
+                                        unsigned int *s)
+      : PixelRenderer(d, w, h, c, bpl, p), scratch(s)
+    { }
+
+    template <unsigned int _Format>
+    void render(void) const;
+  };
+
+} // namespace bt
+
+
+template <unsigned int _Format>
+void bt::OrderedDitherRenderer::render(void) const {
+  unsigned int maxr = 255, maxg = 255, maxb = 255;
+  colortable->map(maxr, maxg, maxb);
+
+  OrderedDitherRow row;
+  row.scale[0] = 256 * maxr + maxr + 1;
+  row.scale[1] = 256 * maxg + maxg + 1;
+  row.scale[2] = 256 * maxb + maxb + 1;
+
+  // without pixel tables, the kernel packs the mapped channels for
+  // pixel() to look up
+  const bool truecolor = colortable->hasPixelTables();
+  row.shift[0] = truecolor ? colortable->redShift()   : 16;
+  row.shift[1] = truecolor ? colortable->greenShift() :  8;
+  row.shift[2] = truecolor ? colortable->blueShift()  :  0;
+
+  const OrderedDitherKernel kernel = orderedDitherKernel();
+  unsigned int * const pixels = scratch;
+  const RGB *p = data;
+  unsigned char *ppixel_data = image_data;
+
+  for (unsigned int y = 0; y < height; ++y) {
+    row.error = dither16[y & 15];
+    kernel(row, p, pixels, width);
+
+    unsigned char *pixel_data = ppixel_data;
+    if (truecolor) {
+      for (unsigned int x = 0; x < width; ++x)
+        assignPixelData<_Format>(pixel_data, pixels[x]);
+    } else {
+      for (unsigned int x = 0; x < width; ++x) {
+        assignPixelData<_Format>(pixel_data,
+                                 colortable->pixel(pixels[x] >> 16,
+                                                   (pixels[x] >> 8) & 0xff,
+                                                   pixels[x] & 0xff));
+      }
+    }
+
+    p += width;
+    ppixel_data += bytes_per_line;
   }
 }
 
 
-void bt::Image::FloydSteinbergDither(XColorTable *colortable,
-                                     unsigned int bit_depth,
-                                     unsigned int bytes_per_line,
-                                     unsigned char *pixel_data) {
-  int * const error = new int[width * 6];
+template <unsigned int _Format>
+void bt::FloydSteinbergDitherRenderer::render(void) const {
+  int * const error = reinterpret_cast<int *>(scratch);
   int * const r_line1 = error + (width * 0);
   int * const g_line1 = error + (width * 1);
   int * const b_line1 = error + (width * 2);
@@ -788,8 +1516,9 @@ void bt::Image::FloydSteinbergDither(XColorTable *colortable,
 
   int rer, ger, ber;
   unsigned int x, y, r, g, b, offset;
-  unsigned char *ppixel_data = pixel_data;
-  RGB *pixels = new RGB[width];
+  unsigned char *pixel_data = image_data,
+               *ppixel_data = image_data;
+  unsigned int * const pixels = scratch + (width * 6);
 
   unsigned int maxr = 255, maxg = 255, maxb = 255;
   colortable->map(maxr, maxg, maxb);
@@ -830,10 +1559,7 @@ void bt::Image::FloydSteinbergDither(XColorTable *colortable,
         b = static_cast<unsigned int>(std::max(std::min(bl1[x], 255), 0));
 
         colortable->map(r, g, b);
-
-        pixels[x].red   = r;
-        pixels[x].green = g;
-        pixels[x].blue  = b;
+        pixels[x] = colortable->pixel(r, g, b);
 
         rer = rl1[x] - static_cast<int>(r * maxr);
         ger = gl1[x] - static_cast<int>(g * maxg);
@@ -863,10 +1589,7 @@ void bt::Image::FloydSteinbergDither(XColorTable *colortable,
         b = static_cast<unsigned int>(std::max(std::min(bl1[x], 255), 0));
 
         colortable->map(r, g, b);
-
-        pixels[x].red   = r;
-        pixels[x].green = g;
-        pixels[x].blue  = b;
+        pixels[x] = colortable->pixel(r, g, b);
 
         rer = rl1[x] - static_cast<int>(r * maxr);
         ger = gl1[x] - static_cast<int>(g * maxg);
@@ -890,31 +1613,60 @@ void bt::Image::FloydSteinbergDither(XColorTable *colortable,
         }
       }
     }
-    for (x = 0; x < width; ++x) {
-      r = pixels[x].red;
-      g = pixels[x].green;
-      b = pixels[x].blue;
-      assignPixelData(bit_depth, &pixel_data, colortable->pixel(r, g, b));
-    }
+    for (x = 0; x < width; ++x)
+      assignPixelData<_Format>(pixel_data, pixels[x]);
 
     offset += width;
     pixel_data = (ppixel_data += bytes_per_line);
   }
-
-  delete [] error;
-  delete [] pixels;
 }
 
 
-Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
-  // get the colortable for the screen. if necessary, we will create one.
-  if (colorTableList.empty())
-    colorTableList.resize(display.screenCount(), 0);
+void bt::Image::renderImageData(XColorTable *colortable,
+                                DitherMode dither_mode,
+                                unsigned int format,
+                                unsigned int bytes_per_line,
+                                unsigned char *pixel_data,
+                                std::vector<unsigned int> &scratch) {
+  if (width <= 1 || height <= 1)
+    dither_mode = NoDither;
+
+  switch (dither_mode) {
+  case bt::FloydSteinbergDither:
+    if (scratch.size() < width * 7)
+      scratch.resize(width * 7);
+    renderPixelData(format,
+                    FloydSteinbergDitherRenderer(data, width, height,
+                                                 colortable, bytes_per_line,
+                                                 pixel_data, &scratch[0]));
+    break;
+
+  case bt::OrderedDither:
+    if (scratch.size() < width)
+      scratch.resize(width);
+    renderPixelData(format,
+                    OrderedDitherRenderer(data, width, height, colortable,
+                                          bytes_per_line, pixel_data,
+                                          &scratch[0]));
+    break;
 
-  if (!colorTableList[screen])
-    colorTableList[screen] = new XColorTable(display, screen, maximumColors());
+  case bt::NoDither:
+    if (colortable->hasPixelTables()) {
+      renderPixelData(format,
+                      TrueColorRenderer(data, width, height, colortable,
+                                        bytes_per_line, pixel_data));
+    } else {
+      renderPixelData(format,
+                      ColorTableRenderer(data, width, height, colortable,
+                                         bytes_per_line, pixel_data));
+    }
+    break;
+  } // switch dither_mode
+}
 
-  XColorTable *colortable = colorTableList[screen];
+
+Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
+  XColorTable *colortable = colorTable(display, screen);
   const ScreenInfo &screeninfo = display.screenInfo(screen);
   XImage *image = 0;
   bool shm_ok = false;
@@ -941,40 +1693,11 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
 
   unsigned char *d = reinterpret_cast<unsigned char *>(image->data);
   unsigned int o = image->bits_per_pixel
-                   + ((image->byte_order == MSBFirst) ? 1 : 0);
-
-  DitherMode dmode =
-    (width > 1 && height > 1) ? colortable->ditherMode() : NoDither;
-
-  // render to XImage
-  switch (dmode) {
-  case bt::FloydSteinbergDither:
-    FloydSteinbergDither(colortable, o, image->bytes_per_line, d);
-    break;
-
-  case bt::OrderedDither:
-    OrderedDither(colortable, o, image->bytes_per_line, d);
-    break;
-
-  case bt::NoDither: {
-    unsigned int x, y, offset, r, g, b;
-    unsigned char *pixel_data = d, *ppixel_data = d;
-
-    for (y = 0, offset = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++offset) {
-        r = data[offset].red;
-        g = data[offset].green;
-        b = data[offset].blue;
-
-        colortable->map(r, g, b);
-        assignPixelData(o, &pixel_data, colortable->pixel(r, g, b));
-      }
-
-      pixel_data = (ppixel_data += image->bytes_per_line);
-    }
-    break;
-  }
-  } // switch dmode
+                   + ((image->byte_order == MSBFirst) ? 1 : 0);
+
+  // render to XImage
+  renderImageData(colortable, colortable->ditherMode(),
+                  o, image->bytes_per_line, d, scratch);
 
   Pixmap pixmap = XCreatePixmap(display.XDisplay(), screeninfo.rootWindow(),
                                 width, height, screeninfo.depth());
@@ -990,10 +1713,7 @@ Pixmap bt::Image::renderPixmap(const Display &display, unsigned int screen) {
 #ifdef MITSHM
   if (shm_ok) {
     // use MIT-SHM extension
-    XShmPutImage(pen.XDisplay(), pixmap, pen.gc(), image,
-                 0, 0, 0, 0, width, height, False);
-
-    destroyShmImage(display, image);
+    putShmImage(display, pixmap, pen.gc(), image);
   } else
 #endif // MITSHM
     {
@@ -1197,6 +1917,385 @@ void bt::Image::sunkenBevel(unsigned int border_width) {
 }
 
 
+namespace bt {
+
+  /*
+    All of the two dimensional gradients are built from a table of
+    per-column values (xt) and a table of per-row values (yt) for each
+    channel.  Each channel of a pixel is computed as
+
+      to - sign * op(xt[x], yt[y])
+
+    truncated to 8 bits, and darkened on odd rows when interlaced.
+    The diagonal gradients use to = 0 and sign = -1.
+
+    gradientRow() is the reference implementation.  When available,
+    SSE2 and AVX2 versions are selected at runtime; they produce
+    exactly the same output.
+  */
+  enum GradientOp {
+    GradientSum,
+    GradientMax,
+    GradientMin,
+    GradientRootSum
+  };
+
+  struct GradientRow {
+    const unsigned int *xt[3];
+    unsigned int yt[3];
+    int to[3];
+    int sign[3];
+    bool darken;
+  };
+
+  typedef void (*GradientKernel)(const GradientRow &row, RGB *p,
+                                 unsigned int width);
+
+  template <GradientOp _Op>
+  static inline int gradientValue(unsigned int x, unsigned int y) {
+    switch (_Op) {
+    case GradientSum:
+      return x + y;
+    case GradientMax:
+      return std::max(x, y);
+    case GradientMin:
+      return std::min(x, y);
+    case GradientRootSum:
+      return static_cast<int>(sqrt(static_cast<double>(x + y)));
+    }
+    return 0; // not reached
+  }
+
+  template <GradientOp _Op>
+  static void gradientRow(const GradientRow &row, RGB *p,
+                          unsigned int begin, unsigned int end) {
+    unsigned char c[3];
+    for (unsigned int x = begin; x < end; ++x) {
+      for (unsigned int i = 0; i < 3; ++i) {
+        c[i] = static_cast<unsigned char>
+               (row.to[i] - (row.sign[i] *
+                             gradientValue<_Op>(row.xt[i][x], row.yt[i])));
+        if (row.darken)
+          c[i] = (c[i] >> 1) + (c[i] >> 2);
+      }
+      p[x].red   = c[0];
+      p[x].green = c[1];
+      p[x].blue  = c[2];
+    }
+  }
+
+  template <GradientOp _Op>
+  static void gradientRow(const GradientRow &row, RGB *p,
+                          unsigned int width)
+  { gradientRow<_Op>(row, p, 0, width); }
+
+#ifdef    SIMD
+  /*
+    The SIMD versions compute 8 (SSE2) or 16 (AVX2) pixels at a time
+    in 16-bit lanes, which is enough to hold the low 8 bits of every
+    intermediate result.  They rely on RGB being a packed 32-bit
+    little-endian word, which is checked before they are used.
+  */
+#  ifdef  __SSE2__
+  template <GradientOp _Op>
+  static inline __m128i gradientValueSSE2(__m128i x, __m128i y);
+
+  template <>
+  inline __m128i gradientValueSSE2<GradientSum>(__m128i x, __m128i y)
+  { return _mm_add_epi32(x, y); }
+
+  template <>
+  inline __m128i gradientValueSSE2<GradientMax>(__m128i x, __m128i y) {
+    // all table values fit in 16 bits, so compare those
+    const __m128i gt = _mm_cmpgt_epi32(x, y);
+    return _mm_or_si128(_mm_and_si128(gt, x), _mm_andnot_si128(gt, y));
+  }
+
+  template <>
+  inline __m128i gradientValueSSE2<GradientMin>(__m128i x, __m128i y) {
+    const __m128i gt = _mm_cmpgt_epi32(x, y);
+    return _mm_or_si128(_mm_and_si128(gt, y), _mm_andnot_si128(gt, x));
+  }
+
+  template <>
+  inline __m128i gradientValueSSE2<GradientRootSum>(__m128i x, __m128i y) {
+    const __m128i s = _mm_add_epi32(x, y);
+    const __m128d lo = _mm_sqrt_pd(_mm_cvtepi32_pd(s));
+    const __m128d hi = _mm_sqrt_pd(_mm_cvtepi32_pd(_mm_srli_si128(s, 8)));
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+  }
+
+  template <GradientOp _Op>
+  static void gradientRowSSE2(const GradientRow &row, RGB *p,
+                              unsigned int width) {
+    const __m128i mask = _mm_set1_epi16(0xff);
+    __m128i yt[3], to[3], sign[3], c[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+      yt[i]   = _mm_set1_epi32(row.yt[i]);
+      to[i]   = _mm_set1_epi16(row.to[i]);
+      sign[i] = _mm_set1_epi16(row.sign[i]);
+    }
+
+    unsigned int x = 0;
+    for (; x + 8 <= width; x += 8) {
+      for (unsigned int i = 0; i < 3; ++i) {
+        const __m128i *xt = reinterpret_cast<const __m128i *>(row.xt[i] + x);
+        const __m128i v =
+          _mm_packs_epi32(gradientValueSSE2<_Op>(_mm_loadu_si128(xt), yt[i]),
+                          gradientValueSSE2<_Op>(_mm_loadu_si128(xt + 1),
+                                                 yt[i]));
+        c[i] = _mm_and_si128(_mm_sub_epi16(to[i], _mm_mullo_epi16(v, sign[i])),
+                             mask);
+        if (row.darken)
+          c[i] = _mm_add_epi16(_mm_srli_epi16(c[i], 1),
+                               _mm_srli_epi16(c[i], 2));
+      }
+
+      const __m128i rg = _mm_or_si128(c[0], _mm_slli_epi16(c[1], 8));
+      __m128i *d = reinterpret_cast<__m128i *>(p + x);
+      _mm_storeu_si128(d,     _mm_unpacklo_epi16(rg, c[2]));
+      _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(rg, c[2]));
+    }
+
+    gradientRow<_Op>(row, p, x, width);
+  }
+#  endif // __SSE2__
+
+  template <GradientOp _Op>
+  __attribute__((target("avx2")))
+  static inline __m256i gradientValueAVX2(__m256i x, __m256i y);
+
+  template <>
+  __attribute__((target("avx2")))
+  inline __m256i gradientValueAVX2<GradientSum>(__m256i x, __m256i y)
+  { return _mm256_add_epi32(x, y); }
+
+  template <>
+  __attribute__((target("avx2")))
+  inline __m256i gradientValueAVX2<GradientMax>(__m256i x, __m256i y)
+  { return _mm256_max_epu32(x, y); }
+
+  template <>
+  __attribute__((target("avx2")))
+  inline __m256i gradientValueAVX2<GradientMin>(__m256i x, __m256i y)
+  { return _mm256_min_epu32(x, y); }
+
+  template <>
+  __attribute__((target("avx2")))
+  inline __m256i gradientValueAVX2<GradientRootSum>(__m256i x, __m256i y) {
+    const __m256i s = _mm256_add_epi32(x, y);
+    const __m256d lo =
+      _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(s)));
+    const __m256d hi =
+      _mm256_sqrt_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(s, 1)));
+    return _mm256_inserti128_si256
+      (_mm256_castsi128_si256(_mm256_cvttpd_epi32(lo)),
+       _mm256_cvttpd_epi32(hi), 1);
+  }
+
+  template <GradientOp _Op>
+  __attribute__((target("avx2")))
+  static void gradientRowAVX2(const GradientRow &row, RGB *p,
+                              unsigned int width) {
+    const __m256i mask = _mm256_set1_epi16(0xff);
+    __m256i yt[3], to[3], sign[3], c[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+      yt[i]   = _mm256_set1_epi32(row.yt[i]);
+      to[i]   = _mm256_set1_epi16(row.to[i]);
+      sign[i] = _mm256_set1_epi16(row.sign[i]);
+    }
+
+    unsigned int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      for (unsigned int i = 0; i < 3; ++i) {
+        const __m256i *xt = reinterpret_cast<const __m256i *>(row.xt[i] + x);
+        // packing works within 128-bit lanes, so restore the order
+        const __m256i v = _mm256_permute4x64_epi64
+          (_mm256_packs_epi32
+           (gradientValueAVX2<_Op>(_mm256_loadu_si256(xt), yt[i]),
+            gradientValueAVX2<_Op>(_mm256_loadu_si256(xt + 1), yt[i])),
+           0xd8);
+        c[i] = _mm256_and_si256(_mm256_sub_epi16(to[i],
+                                                 _mm256_mullo_epi16(v, sign[i])),
+                                mask);
+        if (row.darken)
+          c[i] = _mm256_add_epi16(_mm256_srli_epi16(c[i], 1),
+                                  _mm256_srli_epi16(c[i], 2));
+      }
+
+      const __m256i rg = _mm256_or_si256(c[0], _mm256_slli_epi16(c[1], 8));
+      const __m256i lo = _mm256_unpacklo_epi16(rg, c[2]);
+      const __m256i hi = _mm256_unpackhi_epi16(rg, c[2]);
+      __m256i *d = reinterpret_cast<__m256i *>(p + x);
+      _mm256_storeu_si256(d,     _mm256_permute2x128_si256(lo, hi, 0x20));
+      _mm256_storeu_si256(d + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    gradientRow<_Op>(row, p, x, width);
+  }
+#endif // SIMD
+
+  static GradientKernel gradientKernel(GradientOp op) {
+    static GradientKernel kernels[4] = { 0, 0, 0, 0 };
+    if (!kernels[0]) {
+      kernels[GradientSum]     = gradientRow<GradientSum>;
+      kernels[GradientMax]     = gradientRow<GradientMax>;
+      kernels[GradientMin]     = gradientRow<GradientMin>;
+      kernels[GradientRootSum] = gradientRow<GradientRootSum>;
+
+#ifdef    SIMD
+      if (packedRGB()) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+          kernels[GradientSum]     = gradientRowAVX2<GradientSum>;
+          kernels[GradientMax]     = gradientRowAVX2<GradientMax>;
+          kernels[GradientMin]     = gradientRowAVX2<GradientMin>;
+          kernels[GradientRootSum] = gradientRowAVX2<GradientRootSum>;
+        }
+#  ifdef  __SSE2__
+        else {
+          kernels[GradientSum]     = gradientRowSSE2<GradientSum>;
+          kernels[GradientMax]     = gradientRowSSE2<GradientMax>;
+          kernels[GradientMin]     = gradientRowSSE2<GradientMin>;
+          kernels[GradientRootSum] = gradientRowSSE2<GradientRootSum>;
+        }
+#  endif // __SSE2__
+      }
+#endif // SIMD
+    }
+    return kernels[op];
+  }
+
+  /*
+    Combines the column and row tables into the final image.
+  */
+  static void combineGradient(RGB *data,
+                              unsigned int width, unsigned int height,
+                              GradientOp op,
+                              unsigned int * const xt[3],
+                              unsigned int * const yt[3],
+                              const int to[3], const int sign[3],
+                              bool interlaced) {
+    const GradientKernel kernel = gradientKernel(op);
+    GradientRow row;
+    for (unsigned int i = 0; i < 3; ++i) {
+      row.xt[i]   = xt[i];
+      row.to[i]   = to[i];
+      row.sign[i] = sign[i];
+    }
+
+    for (unsigned int y = 0; y < height; ++y, data += width) {
+      for (unsigned int i = 0; i < 3; ++i)
+        row.yt[i] = yt[i][y];
+      row.darken = interlaced && (y & 1);
+      kernel(row, data, width);
+    }
+  }
+
+  /*
+    A run of columns in the right half of a row.  When mirror is
+    non-zero, column x is a copy of column (mirror - x); otherwise the
+    run is computed.
+  */
+  struct GradientRun {
+    unsigned int begin, end;
+    unsigned int mirror;
+  };
+
+  static inline bool sameTableEntry(unsigned int * const t[3],
+                                    unsigned int a, unsigned int b) {
+    return (t[0][a] == t[0][b] && t[1][a] == t[1][b] && t[2][a] == t[2][b]);
+  }
+
+  /*
+    The pyramid, rectangle, elliptic and pipe cross gradients are
+    symmetric about both axes, apart from rounding in their tables.
+    For these, only the left half of each row and the top half of the
+    image are computed.  A column or row in the other half is copied
+    from its mirror image whenever the tables (and, when interlaced,
+    the row parity) show that the two are identical, and computed
+    otherwise, so the result is exactly that of combineGradient().
+  */
+  static void combineSymmetricGradient(RGB *data,
+                                       unsigned int width,
+                                       unsigned int height,
+                                       GradientOp op,
+                                       unsigned int * const xt[3],
+                                       unsigned int * const yt[3],
+                                       const int to[3], const int sign[3],
+                                       bool interlaced) {
+    const GradientKernel kernel = gradientKernel(op);
+    GradientRow row;
+    for (unsigned int i = 0; i < 3; ++i) {
+      row.to[i]   = to[i];
+      row.sign[i] = sign[i];
+    }
+
+    // the tables step from one end to the other, so the mirror image
+    // of column x is usually column (width - x), but rounding may
+    // make it (width - 1 - x)
+    const unsigned int half = width / 2 + 1;
+    std::vector<GradientRun> runs;
+    for (unsigned int x = half; x < width; ++x) {
+      unsigned int mirror = 0;
+      if (sameTableEntry(xt, x, width - x))
+        mirror = width;
+      else if (sameTableEntry(xt, x, width - 1 - x))
+        mirror = width - 1;
+
+      if (runs.empty() || runs.back().mirror != mirror) {
+        const GradientRun run = { x, x + 1, mirror };
+        runs.push_back(run);
+      } else {
+        runs.back().end = x + 1;
+      }
+    }
+
+    RGB *p = data;
+    for (unsigned int y = 0; y < height; ++y, p += width) {
+      // likewise, copy whole rows from the mirror row or a neighbour of
+      // it, which must have the same parity when interlaced
+      if (y > height / 2) {
+        const unsigned int candidates[3] = {
+          height - y, height - 1 - y, height + 1 - y
+        };
+        bool copied = false;
+        for (unsigned int c = 0; c < 3 && !copied; ++c) {
+          const unsigned int src = candidates[c];
+          if (src >= y || (interlaced && (src & 1) != (y & 1))
+              || !sameTableEntry(yt, src, y))
+            continue;
+          memcpy(p, data + (src * width), width * sizeof(RGB));
+          copied = true;
+        }
+        if (copied)
+          continue;
+      }
+
+      for (unsigned int i = 0; i < 3; ++i) {
+        row.xt[i] = xt[i];
+        row.yt[i] = yt[i][y];
+      }
+      row.darken = interlaced && (y & 1);
+      kernel(row, p, half);
+
+      for (std::vector<GradientRun>::const_iterator it = runs.begin();
+           it != runs.end(); ++it) {
+        if (it->mirror) {
+          for (unsigned int x = it->begin; x < it->end; ++x)
+            p[x] = p[it->mirror - x];
+        } else {
+          for (unsigned int i = 0; i < 3; ++i)
+            row.xt[i] = xt[i] + it->begin;
+          kernel(row, p + it->begin, it->end - it->begin);
+        }
+      }
+    }
+  }
+
+} // namespace bt
+
+
 void bt::Image::dgradient(const Color &from, const Color &to,
                           bool interlaced) {
   // diagonal gradient code was written by Mike Cole <mike@mydot.com>
@@ -1208,7 +2307,6 @@ void bt::Image::dgradient(const Color &from, const Color &to,
          xg = static_cast<double>(from.green()),
          xb = static_cast<double>(from.blue());
 
-  RGB *p = data;
   unsigned int w = width * 2, h = height * 2;
   unsigned int x, y;
 
@@ -1257,32 +2355,10 @@ void bt::Image::dgradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal dgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { 0, 0, 0 };
+  const int sign[3] = { -1, -1, -1 };
+  combineGradient(data, width, height, GradientSum,
+                  xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1295,7 +2371,6 @@ void bt::Image::hgradient(const Color &from, const Color &to,
     xg = static_cast<double>(from.green()),
     xb = static_cast<double>(from.blue());
   RGB *p = data;
-  unsigned int total = width * (height - 2);
   unsigned int x;
 
   drx = static_cast<double>(to.red()   - from.red());
@@ -1358,9 +2433,15 @@ void bt::Image::hgradient(const Color &from, const Color &to,
   }
 
   if (height > 2) {
-    // rest of the gradient
-    for (x = 0; x < total; ++x)
-      p[x] = data[x];
+    // rest of the gradient, repeating the first two lines in
+    // increasingly large blocks
+    unsigned int done = width * 2;
+    const unsigned int total = width * height;
+    while (done < total) {
+      const unsigned int n = std::min(done, total - done);
+      memcpy(data + done, data, n * sizeof(RGB));
+      done += n;
+    }
   }
 }
 
@@ -1431,7 +2512,6 @@ void bt::Image::pgradient(const Color &from, const Color &to,
 
   double yr, yg, yb, drx, dgx, dbx, dry, dgy, dby, xr, xg, xb;
   int rsign, gsign, bsign;
-  RGB *p = data;
   unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
   unsigned int x, y;
 
@@ -1488,38 +2568,12 @@ void bt::Image::pgradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal pgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign * (xt[0][x] + yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign * (xt[1][x] + yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign * (xt[2][x] + yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign * (xt[0][x] + yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign * (xt[1][x] + yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign * (xt[2][x] + yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { static_cast<int>(tr),
+                          static_cast<int>(tg),
+                          static_cast<int>(tb) };
+  const int sign[3] = { rsign, gsign, bsign };
+  combineSymmetricGradient(data, width, height, GradientSum,
+                            xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1533,7 +2587,6 @@ void bt::Image::rgradient(const Color &from, const Color &to,
 
   double drx, dgx, dbx, dry, dgy, dby, xr, xg, xb, yr, yg, yb;
   int rsign, gsign, bsign;
-  RGB *p = data;
   unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
   unsigned int x, y;
 
@@ -1590,44 +2643,12 @@ void bt::Image::rgradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal rgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::max(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::max(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::max(xt[2][x], yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::max(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::max(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::max(xt[2][x], yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { static_cast<int>(tr),
+                          static_cast<int>(tg),
+                          static_cast<int>(tb) };
+  const int sign[3] = { rsign, gsign, bsign };
+  combineSymmetricGradient(data, width, height, GradientMax,
+                            xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1641,7 +2662,6 @@ void bt::Image::egradient(const Color &from, const Color &to,
 
   double drx, dgx, dbx, dry, dgy, dby, yr, yg, yb, xr, xg, xb;
   int rsign, gsign, bsign;
-  RGB *p = data;
   unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
   unsigned int x, y;
 
@@ -1698,44 +2718,12 @@ void bt::Image::egradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal egradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = static_cast<unsigned char>
-                   (tr - (rsign * static_cast<int>(sqrt(xt[0][x] +
-                                                        yt[0][y]))));
-        p->green = static_cast<unsigned char>
-                   (tg - (gsign * static_cast<int>(sqrt(xt[1][x] +
-                                                        yt[1][y]))));
-        p->blue  = static_cast<unsigned char>
-                   (tb - (bsign * static_cast<int>(sqrt(xt[2][x] +
-                                                        yt[2][y]))));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = static_cast<unsigned char>
-                   (tr - (rsign * static_cast<int>(sqrt(xt[0][x]
-                                                        + yt[0][y]))));
-        p->green = static_cast<unsigned char>
-                   (tg - (gsign * static_cast<int>(sqrt(xt[1][x]
-                                                        + yt[1][y]))));
-        p->blue  = static_cast<unsigned char>
-                   (tb - (bsign * static_cast<int>(sqrt(xt[2][x]
-                                                        + yt[2][y]))));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { static_cast<int>(tr),
+                          static_cast<int>(tg),
+                          static_cast<int>(tb) };
+  const int sign[3] = { rsign, gsign, bsign };
+  combineSymmetricGradient(data, width, height, GradientRootSum,
+                            xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1749,7 +2737,6 @@ void bt::Image::pcgradient(const Color &from, const Color &to,
 
   double drx, dgx, dbx, dry, dgy, dby, xr, xg, xb, yr, yg, yb;
   int rsign, gsign, bsign;
-  RGB *p = data;
   unsigned int tr = to.red(), tg = to.green(), tb = to.blue();
   unsigned int x, y;
 
@@ -1806,44 +2793,12 @@ void bt::Image::pcgradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal rgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::min(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::min(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::min(xt[2][x], yt[2][y])));
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red =
-          static_cast<unsigned char>(tr - (rsign *
-                                           std::min(xt[0][x], yt[0][y])));
-        p->green =
-          static_cast<unsigned char>(tg - (gsign *
-                                           std::min(xt[1][x], yt[1][y])));
-        p->blue =
-          static_cast<unsigned char>(tb - (bsign *
-                                           std::min(xt[2][x], yt[2][y])));
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { static_cast<int>(tr),
+                          static_cast<int>(tg),
+                          static_cast<int>(tb) };
+  const int sign[3] = { rsign, gsign, bsign };
+  combineSymmetricGradient(data, width, height, GradientMin,
+                            xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1860,7 +2815,6 @@ void bt::Image::cdgradient(const Color &from, const Color &to,
          xr = static_cast<double>(from.red()  ),
          xg = static_cast<double>(from.green()),
          xb = static_cast<double>(from.blue() );
-  RGB *p = data;
   unsigned int w = width * 2, h = height * 2;
   unsigned int x, y;
 
@@ -1913,32 +2867,10 @@ void bt::Image::cdgradient(const Color &from, const Color &to,
   }
 
   // Combine tables to create gradient
-
-  if (!interlaced) {
-    // normal dgradient
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-      }
-    }
-  } else {
-    // interlacing effect
-    for (y = 0; y < height; ++y) {
-      for (x = 0; x < width; ++x, ++p) {
-        p->red   = xt[0][x] + yt[0][y];
-        p->green = xt[1][x] + yt[1][y];
-        p->blue  = xt[2][x] + yt[2][y];
-
-        if (y & 1) {
-          p->red   = (p->red   >> 1) + (p->red   >> 2);
-          p->green = (p->green >> 1) + (p->green >> 2);
-          p->blue  = (p->blue  >> 1) + (p->blue  >> 2);
-        }
-      }
-    }
-  }
+  const int target[3] = { 0, 0, 0 };
+  const int sign[3] = { -1, -1, -1 };
+  combineGradient(data, width, height, GradientSum,
+                  xt, yt, target, sign, interlaced);
 
   delete [] alloc;
 }
@@ -1968,3 +2900,397 @@ void bt::Image::svgradient(const Color &from, const Color &to,
   partial_vgradient(h1, from, interlaced, 0, height/2);
   partial_vgradient(to, h2, interlaced, height/2, height);
 }
+
+
+#ifdef    RENDER_THREADS
+namespace bt {
+
+  /*
+    Large images can be rendered by a small pool of worker threads.
+    The main thread creates the pixmap, fills it with the first color
+    of the texture and queues a RenderJob.  A worker computes the
+    gradient, bevel and dithering into the pixel data of the job, and
+    wakes the main thread through an eventfd that is watched by
+    bt::Application::run().  The main thread then puts the pixel data
+    into the pixmap and clears every window that drew the pixmap in
+    the meantime, so that they are exposed again.  Workers never call
+    Xlib.
+  */
+  struct RenderJob {
+    const Display &display;
+    const unsigned int screen;
+    const Pixmap pixmap;
+    const Texture texture;
+    Image image;
+    XColorTable *colortable;
+    DitherMode dither_mode;
+    unsigned int format;
+    unsigned int bytes_per_line;
+    // the RGB data was read from the disk cache
+    bool cached;
+    // set by the main thread, with the queue mutex held
+    bool cancelled;
+    Buffer pixel_data;
+    // windows to clear when the pixmap is ready
+    std::vector<Window> windows;
+
+    inline RenderJob(const Display &d, unsigned int s, Pixmap p,
+                     const Texture &t, unsigned int w, unsigned int h)
+      : display(d), screen(s), pixmap(p), texture(t), image(w, h),
+        colortable(0), dither_mode(NoDither), format(0u),
+        bytes_per_line(0u), cached(false), cancelled(false)
+    { }
+  };
+
+
+  class RenderQueue {
+  public:
+    RenderQueue(void);
+    ~RenderQueue(void);
+
+    inline int fd(void) const
+    { return event_fd; }
+
+    bool start(unsigned int count);
+    void push(RenderJob *job);
+    RenderJob *find(Pixmap pixmap) const;
+    void cancel(Pixmap pixmap);
+    void forget(Window window);
+    void processCompletions(void);
+
+  private:
+    static void *run(void *arg);
+    void work(void);
+    void finish(RenderJob *job);
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<RenderJob *> queue, done;
+    bool quit;
+    int event_fd;
+    std::vector<pthread_t> threads;
+
+    // jobs that have not been completed, only used by the main thread
+    typedef std::map<Pixmap, RenderJob *> JobMap;
+    JobMap jobs;
+  };
+
+
+  static RenderQueue *render_queue = 0;
+
+
+  int renderCompletionFd(void)
+  { return render_queue ? render_queue->fd() : -1; }
+
+
+  void processRenderCompletions(void) {
+    if (render_queue)
+      render_queue->processCompletions();
+  }
+
+
+  void forgetRenderWindow(Window window) {
+    if (render_queue)
+      render_queue->forget(window);
+  }
+
+
+  void destroyRenderQueue(void) {
+    delete render_queue;
+    render_queue = 0;
+  }
+
+} // namespace bt
+
+
+bt::RenderQueue::RenderQueue(void)
+  : quit(false)
+{
+  pthread_mutex_init(&mutex, 0);
+  pthread_cond_init(&cond, 0);
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  // the kernels are selected lazily, make sure the workers do not
+  // race to do it
+  (void) gradientKernel(GradientSum);
+  (void) orderedDitherKernel();
+}
+
+
+bt::RenderQueue::~RenderQueue(void) {
+  pthread_mutex_lock(&mutex);
+  quit = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  std::vector<pthread_t>::const_iterator it = threads.begin(),
+                                        end = threads.end();
+  for (; it != end; ++it)
+    pthread_join(*it, 0);
+
+  std::for_each(queue.begin(), queue.end(), PointerAssassin());
+  std::for_each(done.begin(), done.end(), PointerAssassin());
+
+  if (event_fd != -1)
+    close(event_fd);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+  Starts worker threads until there are count of them.  Returns true
+  if there is at least one.
+*/
+bool bt::RenderQueue::start(unsigned int count) {
+  if (event_fd == -1)
+    return false;
+
+  while (threads.size() < count) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, run, this) != 0) {
+      fprintf(stderr,
+              gettext("bt::RenderQueue: failed to start render thread\n"));
+      break;
+    }
+    threads.push_back(thread);
+  }
+  return !threads.empty();
+}
+
+
+void *bt::RenderQueue::run(void *arg) {
+  // workers never handle signals, bt::Application does
+  sigset_t set;
+  sigfillset(&set);
+  pthread_sigmask(SIG_BLOCK, &set, 0);
+
+  static_cast<RenderQueue *>(arg)->work();
+  return 0;
+}
+
+
+void bt::RenderQueue::work(void) {
+  Scratch scratch;
+
+  for (;;) {
+    pthread_mutex_lock(&mutex);
+    while (queue.empty() && !quit)
+      pthread_cond_wait(&cond, &mutex);
+    if (quit) {
+      pthread_mutex_unlock(&mutex);
+      break;
+    }
+    RenderJob * const job = queue.front();
+    queue.pop_front();
+    const bool cancelled = job->cancelled;
+    pthread_mutex_unlock(&mutex);
+
+    if (!cancelled) {
+      if (!job->cached)
+        job->image.renderTexture(job->texture);
+      job->image.renderImageData(job->colortable, job->dither_mode,
+                                 job->format, job->bytes_per_line,
+                                 &job->pixel_data[0], scratch);
+    }
+
+    pthread_mutex_lock(&mutex);
+    done.push_back(job);
+    pthread_mutex_unlock(&mutex);
+
+    const uint64_t one = 1;
+    (void) write(event_fd, &one, sizeof(one));
+  }
+}
+
+
+void bt::RenderQueue::push(RenderJob *job) {
+  jobs.insert(JobMap::value_type(job->pixmap, job));
+
+  pthread_mutex_lock(&mutex);
+  queue.push_back(job);
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+
+bt::RenderJob *bt::RenderQueue::find(Pixmap pixmap) const {
+  JobMap::const_iterator it = jobs.find(pixmap);
+  return (it != jobs.end()) ? it->second : 0;
+}
+
+
+void bt::RenderQueue::cancel(Pixmap pixmap) {
+  JobMap::iterator it = jobs.find(pixmap);
+  if (it == jobs.end())
+    return;
+
+  // the job is deleted when the worker is done with it
+  pthread_mutex_lock(&mutex);
+  it->second->cancelled = true;
+  pthread_mutex_unlock(&mutex);
+  jobs.erase(it);
+}
+
+
+// the window is being destroyed, don't clear it when a job finishes
+void bt::RenderQueue::forget(Window window) {
+  JobMap::const_iterator it = jobs.begin(), end = jobs.end();
+  for (; it != end; ++it) {
+    std::vector<Window> &windows = it->second->windows;
+    windows.erase(std::remove(windows.begin(), windows.end(), window),
+                  windows.end());
+  }
+}
+
+
+void bt::RenderQueue::processCompletions(void) {
+  uint64_t count;
+  (void) read(event_fd, &count, sizeof(count));
+
+  std::deque<RenderJob *> finished;
+  pthread_mutex_lock(&mutex);
+  finished.swap(done);
+  pthread_mutex_unlock(&mutex);
+
+  std::deque<RenderJob *>::const_iterator it = finished.begin(),
+                                         end = finished.end();
+  for (; it != end; ++it) {
+    RenderJob * const job = *it;
+    if (!job->cancelled) {
+      jobs.erase(job->pixmap);
+      finish(job);
+    }
+    delete job;
+  }
+}
+
+
+void bt::RenderQueue::finish(RenderJob *job) {
+  const unsigned int width = job->image.width, height = job->image.height;
+  if (!job->cached && useDiskCache(width, height))
+    writeDiskCache(job->texture, width, height, job->image.data);
+
+  const Display &display = job->display;
+  const ScreenInfo &screeninfo = display.screenInfo(job->screen);
+  Pen pen(job->screen, Color(0, 0, 0));
+  bool put = false;
+
+#ifdef MITSHM
+  XImage *image = createShmImage(display, screeninfo, width, height);
+  if (image) {
+    if (static_cast<unsigned int>(image->bytes_per_line)
+        == job->bytes_per_line) {
+      memcpy(image->data, &job->pixel_data[0], job->pixel_data.size());
+      putShmImage(display, job->pixmap, pen.gc(), image);
+      put = true;
+    } else {
+      image->data = 0;
+      image->obdata = 0;
+      XDestroyImage(image);
+    }
+  }
+#endif // MITSHM
+
+  if (!put) {
+    XImage *image =
+      XCreateImage(display.XDisplay(), screeninfo.visual(),
+                   screeninfo.depth(), ZPixmap, 0,
+                   reinterpret_cast<char *>(&job->pixel_data[0]),
+                   width, height, 32, job->bytes_per_line);
+    if (image) {
+      XPutImage(pen.XDisplay(), job->pixmap, pen.gc(), image,
+                0, 0, 0, 0, width, height);
+      image->data = 0;
+      XDestroyImage(image);
+    }
+  }
+
+  drawBorder(job->screen, job->texture, job->pixmap, width, height);
+
+  std::vector<Window>::const_iterator it = job->windows.begin(),
+                                     end = job->windows.end();
+  for (; it != end; ++it)
+    XClearArea(display.XDisplay(), *it, 0, 0, 0, 0, True);
+}
+
+
+Pixmap bt::Image::renderDeferred(const Display &display, unsigned int screen,
+                                 const bt::Texture &texture) {
+  if (!render_queue)
+    render_queue = new RenderQueue;
+  if (!render_queue->start(renderThreads()))
+    return render(display, screen, texture, false);
+
+  XColorTable *colortable = colorTable(display, screen);
+  const ScreenInfo &screeninfo = display.screenInfo(screen);
+
+  // find the format of the pixel data
+  XImage *image = XCreateImage(display.XDisplay(), screeninfo.visual(),
+                               screeninfo.depth(), ZPixmap,
+                               0, 0, width, height, 32, 0);
+  if (!image)
+    return None;
+  const unsigned int format = image->bits_per_pixel
+                              + ((image->byte_order == MSBFirst) ? 1 : 0);
+  const unsigned int bytes_per_line = image->bytes_per_line;
+  XDestroyImage(image);
+
+  Pixmap pixmap = XCreatePixmap(display.XDisplay(), screeninfo.rootWindow(),
+                                width, height, screeninfo.depth());
+  if (pixmap == None)
+    return None;
+
+  // the placeholder, until the worker is done
+  Pen pen(screen, texture.color1());
+  XFillRectangle(pen.XDisplay(), pixmap, pen.gc(), 0, 0, width, height);
+  drawBorder(screen, texture, pixmap, width, height);
+
+  RenderJob *job = new RenderJob(display, screen, pixmap, texture,
+                                 width, height);
+  job->colortable = colortable;
+  job->dither_mode = colortable->ditherMode();
+  job->format = format;
+  job->bytes_per_line = bytes_per_line;
+  job->image.data = new RGB[width * height];
+  job->cached = (useDiskCache(width, height)
+                 && readDiskCache(texture, width, height, job->image.data));
+  job->pixel_data.resize(bytes_per_line * height);
+  render_queue->push(job);
+
+  return pixmap;
+}
+#endif // RENDER_THREADS
+
+
+void bt::Image::exposeWhenRendered(Pixmap pixmap, Window window) {
+#ifdef    RENDER_THREADS
+  RenderJob * const job = render_queue ? render_queue->find(pixmap) : 0;
+  if (job && std::find(job->windows.begin(), job->windows.end(), window)
+             == job->windows.end())
+    job->windows.push_back(window);
+#else
+  (void) pixmap;
+  (void) window;
+#endif // RENDER_THREADS
+}
+
+
+bool bt::Image::isRendering(Pixmap pixmap) {
+#ifdef    RENDER_THREADS
+  return render_queue && render_queue->find(pixmap) != 0;
+#else
+  (void) pixmap;
+  return false;
+#endif // RENDER_THREADS
+}
+
+
+void bt::Image::cancelRender(Pixmap pixmap) {
+#ifdef    RENDER_THREADS
+  if (render_queue)
+    render_queue->cancel(pixmap);
+#else
+  (void) pixmap;
+#endif // RENDER_THREADS
+}
@@ -27,6 +27,8 @@
 
 #include "Util.hh"
 
+#include <vector>
+
 namespace bt {
 
   // forward declarations
@@ -61,26 +63,69 @@ namespace bt {
     static inline void setDitherMode(DitherMode dithermode)
     { global_ditherMode = dithermode; }
 
+    /*
+      Large images are also cached on disk, in the XDG cache directory.
+      Returns the limit for the disk cache in kilobytes; the default is
+      32 megabytes.  A limit of zero disables the disk cache.
+    */
+    static inline unsigned long diskCacheLimit(void)
+    { return global_diskCacheLimit; }
+    static inline void setDiskCacheLimit(unsigned long limit)
+    { global_diskCacheLimit = limit; }
+
+    /*
+      Large images can be rendered in the background by a pool of
+      worker threads.  Returns the number of worker threads; the
+      default is zero, which renders all images immediately.
+    */
+    static inline unsigned int renderThreads(void)
+    { return global_renderThreads; }
+    static inline void setRenderThreads(unsigned int threads)
+    { global_renderThreads = threads; }
+
+    /*
+      If the pixmap is still being rendered in the background, the
+      window is cleared, with exposures, when it is ready.  Until
+      then, the pixmap is filled with the first color of the texture.
+    */
+    static void exposeWhenRendered(Pixmap pixmap, Window window);
+    /*
+      Discards the background rendering of the pixmap, if any.  This
+      must be called before the pixmap is freed.
+    */
+    static void cancelRender(Pixmap pixmap);
+    /*
+      Returns true if the pixmap is still being rendered in the
+      background.
+    */
+    static bool isRendering(Pixmap pixmap);
+
     Image(unsigned int w, unsigned int h);
     ~Image(void);
 
+    /*
+      Renders the texture.  If deferred is true and the image is
+      large, the pixmap may be rendered in the background (see
+      renderThreads() above).
+    */
     Pixmap render(const Display &display, unsigned int screen,
-                  const Texture &texture);
+                  const Texture &texture, bool deferred = false);
 
   private:
     RGB *data;
     unsigned int width, height;
 
-    void OrderedDither(XColorTable *colortable,
-                       unsigned int bit_depth,
-                       unsigned int bytes_per_line,
-                       unsigned char *pixel_data);
-    void FloydSteinbergDither(XColorTable *colortable,
-                              unsigned int bit_depth,
-                              unsigned int bytes_per_line,
-                              unsigned char *pixel_data);
+    void renderTexture(const Texture &texture);
+    void renderImageData(XColorTable *colortable,
+                         DitherMode dither_mode,
+                         unsigned int format,
+                         unsigned int bytes_per_line,
+                         unsigned char *pixel_data,
+                         std::vector<unsigned int> &scratch);
 
     Pixmap renderPixmap(const Display &display, unsigned int screen);
+    Pixmap renderDeferred(const Display &display, unsigned int screen,
+                          const Texture &texture);
 
     void raisedBevel(unsigned int border_width = 0);
     void sunkenBevel(unsigned int border_width = 0);
@@ -99,6 +144,10 @@ namespace bt {
 
     static unsigned int global_maximumColors;
     static DitherMode global_ditherMode;
+    static unsigned long global_diskCacheLimit;
+    static unsigned int global_renderThreads;
+
+    friend class RenderQueue;
   };
 
 } // namespace bt
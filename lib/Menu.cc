@@ -962,10 +962,14 @@ void bt::Menu::exposeEvent(const XExposeEvent * const event) {
   MenuStyle* style = MenuStyle::get(_app, _screen);
   Rect r(event->x, event->y, event->width, event->height);
 
+  // text is drawn whole, so the title and items are repainted whole
+  // instead of drawing their text twice over the same background
   if (_show_title && r.intersects(_trect)) {
     drawTexture(_screen, style->titleTexture(), _window,
-                _trect, r & _trect, _tpixmap);
+                _trect, _trect, _tpixmap);
     style->drawTitle(_window, _trect, _title);
+    // the frame is drawn over the bottom of the title
+    r |= _trect & _frect;
   }
 
   if (r.intersects(_frect)) {
@@ -986,8 +990,13 @@ void bt::Menu::exposeEvent(const XExposeEvent * const event) {
     // note: we are reusing r from above, which is no longer needed now
     r.setHeight(it->height);
 
-    if (r.intersects(u))
+    if (r.intersects(u)) {
+      if ((r & u) != r) {
+        drawTexture(_screen, style->frameTexture(), _window,
+                    _frect, r, _fpixmap);
+      }
       style->drawItem(_window, r, *it, _apixmap);
+    }
 
     positionRect(r, row, col);
   }
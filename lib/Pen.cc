@@ -22,12 +22,15 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include "gettext.h"
 #include "Pen.hh"
 #include "Display.hh"
 #include "Color.hh"
 #include "Util.hh"
 
 #include <algorithm>
+#include <list>
+#include <map>
 
 #include <X11/Xlib.h>
 #ifdef XFT
@@ -37,6 +40,9 @@
 #include <assert.h>
 #include <cstdio>
 
+// #define PENCACHE_DEBUG
+
+
 namespace bt {
 
   class PenLoader
@@ -54,40 +60,264 @@ namespace bt {
 
   static PenLoader *penloader = 0;
 
+
+  struct PenCacheKey {
+    unsigned int screen;
+    unsigned long pixel;
+    int function;
+    int linewidth;
+    int subwindow;
+
+    inline bool operator<(const PenCacheKey &x) const {
+      if (screen != x.screen)
+        return screen < x.screen;
+      if (pixel != x.pixel)
+        return pixel < x.pixel;
+      if (function != x.function)
+        return function < x.function;
+      if (linewidth != x.linewidth)
+        return linewidth < x.linewidth;
+      return subwindow < x.subwindow;
+    }
+  };
+
+  struct PenCacheItem {
+    const PenCacheKey key;
+    GC gc;
+    unsigned int count;
+    // position in the unused list, when count is zero
+    std::list<PenCacheItem *>::iterator unused;
+
+    inline PenCacheItem(const PenCacheKey &k)
+      : key(k), gc(0), count(0u)
+    { }
+  };
+
+  class PenCache {
+  public:
+    PenCache(const Display &display);
+    ~PenCache(void);
+
+    PenCacheItem *find(const PenCacheKey &key);
+    void release(PenCacheItem *item);
+    void clear(bool force);
+
+    XftDraw *xftDraw(unsigned int screen, Drawable drawable);
+    void releaseXftDraw(Drawable drawable);
+
+    unsigned long hits, misses;
+
+  private:
+    void erase(PenCacheItem *item);
+
+    const Display &_display;
+
+    typedef std::map<PenCacheKey, PenCacheItem *> ItemMap;
+    ItemMap items;
+    // unused items, least recently released first
+    typedef std::list<PenCacheItem *> UnusedList;
+    UnusedList unused;
+
+#ifdef XFT
+    typedef std::map<Drawable, XftDraw *> XftDrawMap;
+    XftDrawMap xftdraws;
+#endif
+  };
+
+  // unused GCs kept for reuse
+  static const unsigned int max_unused_gcs = 32u;
+
+  static PenCache *pencache = 0;
+
   void createPenLoader(const Display &display)
   {
     assert(penloader == 0);
     penloader = new PenLoader(display);
+    pencache = new PenCache(display);
   }
   void destroyPenLoader(void)
   {
+    delete pencache;
+    pencache = 0;
     delete penloader;
     penloader = 0;
   }
 
 } // namespace bt
 
+
+bt::PenCache::PenCache(const Display &display)
+  : hits(0ul), misses(0ul), _display(display)
+{ }
+
+
+bt::PenCache::~PenCache(void)
+{
+#ifdef PENCACHE_DEBUG
+  fprintf(stderr, gettext("bt::PenCache: %lu hits, %lu misses\n"),
+          hits, misses);
+#endif // PENCACHE_DEBUG
+
+  clear(true);
+
+#ifdef XFT
+  XftDrawMap::const_iterator it = xftdraws.begin(), end = xftdraws.end();
+  for (; it != end; ++it)
+    XftDrawDestroy(it->second);
+  xftdraws.clear();
+#endif
+}
+
+
+bt::PenCacheItem *bt::PenCache::find(const PenCacheKey &key)
+{
+  ItemMap::iterator it = items.find(key);
+  if (it != items.end()) {
+    ++hits;
+    PenCacheItem *item = it->second;
+    if (item->count++ == 0)
+      unused.erase(item->unused);
+    return item;
+  }
+
+  ++misses;
+  PenCacheItem *item = new PenCacheItem(key);
+  XGCValues gcv;
+  gcv.foreground = key.pixel;
+  gcv.function = key.function;
+  gcv.line_width = key.linewidth;
+  gcv.subwindow_mode = key.subwindow;
+  item->gc = XCreateGC(_display.XDisplay(),
+                       _display.screenInfo(key.screen).rootWindow(),
+                       (GCForeground
+                        | GCFunction
+                        | GCLineWidth
+                        | GCSubwindowMode),
+                       &gcv);
+  item->count = 1u;
+  items.insert(ItemMap::value_type(key, item));
+
+#ifdef PENCACHE_DEBUG
+  fprintf(stderr, gettext("bt::PenCache: add %p, %lu items\n"),
+          static_cast<void *>(item->gc),
+          static_cast<unsigned long>(items.size()));
+#endif // PENCACHE_DEBUG
+
+  return item;
+}
+
+
+void bt::PenCache::release(PenCacheItem *item)
+{
+  assert(item->count > 0);
+  if (--item->count > 0)
+    return;
+
+  item->unused = unused.insert(unused.end(), item);
+  if (unused.size() > max_unused_gcs) {
+    PenCacheItem *oldest = unused.front();
+    unused.pop_front();
+    erase(oldest);
+  }
+}
+
+
+void bt::PenCache::erase(PenCacheItem *item)
+{
+#ifdef PENCACHE_DEBUG
+  fprintf(stderr, gettext("bt::PenCache: fre %p\n"),
+          static_cast<void *>(item->gc));
+#endif // PENCACHE_DEBUG
+
+  XFreeGC(_display.XDisplay(), item->gc);
+  items.erase(item->key);
+  delete item;
+}
+
+
+void bt::PenCache::clear(bool force)
+{
+  UnusedList::const_iterator it = unused.begin(), end = unused.end();
+  for (; it != end; ++it)
+    erase(*it);
+  unused.clear();
+
+  if (!force)
+    return;
+
+  while (!items.empty())
+    erase(items.begin()->second);
+}
+
+
+XftDraw *bt::PenCache::xftDraw(unsigned int screen, Drawable drawable)
+{
+#ifdef XFT
+  XftDrawMap::iterator it = xftdraws.find(drawable);
+  if (it != xftdraws.end())
+    return it->second;
+
+  const ScreenInfo &screeninfo = _display.screenInfo(screen);
+  XftDraw *draw = XftDrawCreate(_display.XDisplay(),
+                                drawable,
+                                screeninfo.visual(),
+                                screeninfo.colormap());
+  assert(draw != 0);
+  xftdraws.insert(XftDrawMap::value_type(drawable, draw));
+  return draw;
+#else
+  (void) screen;
+  (void) drawable;
+  return 0;
+#endif
+}
+
+
+void bt::PenCache::releaseXftDraw(Drawable drawable)
+{
+#ifdef XFT
+  XftDrawMap::iterator it = xftdraws.find(drawable);
+  if (it == xftdraws.end())
+    return;
+  XftDrawDestroy(it->second);
+  xftdraws.erase(it);
+#else
+  (void) drawable;
+#endif
+}
+
+
+void bt::Pen::clearCache(void)
+{ pencache->clear(false); }
+
+
+unsigned long bt::Pen::cacheHits(void)
+{ return pencache->hits; }
+
+
+unsigned long bt::Pen::cacheMisses(void)
+{ return pencache->misses; }
+
+
+void bt::Pen::releaseXftDraw(Drawable drawable)
+{ pencache->releaseXftDraw(drawable); }
+
+
 bt::Pen::Pen(unsigned int screen_)
   : _screen(screen_), _function(GXcopy),  _linewidth(0),
-    _subwindow(ClipByChildren), _dirty(false), _gc(0), _xftdraw(0)
+    _subwindow(ClipByChildren), _dirty(false), _item(0)
 { }
 
 bt::Pen::Pen(unsigned int screen_, const Color &color_)
   : _screen(screen_), _color(color_), _function(GXcopy), _linewidth(0),
-    _subwindow(ClipByChildren), _dirty(false), _gc(0), _xftdraw(0)
+    _subwindow(ClipByChildren), _dirty(false), _item(0)
 { }
 
 bt::Pen::~Pen(void)
 {
-  if (_gc)
-    XFreeGC(penloader->XDisplay(), _gc);
-  _gc = 0;
-
-#ifdef XFT
-  if (_xftdraw)
-    XftDrawDestroy(_xftdraw);
-  _xftdraw = 0;
-#endif
+  if (_item)
+    pencache->release(_item);
+  _item = 0;
 }
 
 void bt::Pen::setColor(const Color &color_)
@@ -122,52 +352,25 @@ const bt::Display &bt::Pen::display(void) const
 
 const GC &bt::Pen::gc(void) const
 {
-  if (!_gc || _dirty) {
-    XGCValues gcv;
-    gcv.foreground = _color.pixel(_screen);
-    gcv.function = _function;
-    gcv.line_width = _linewidth;
-    gcv.subwindow_mode = _subwindow;
-    if (!_gc) {
-      _gc = XCreateGC(penloader->XDisplay(),
-                      penloader->display().screenInfo(_screen).rootWindow(),
-                      (GCForeground
-                       | GCFunction
-                       | GCLineWidth
-                       | GCSubwindowMode),
-                      &gcv);
-
-    } else {
-      XChangeGC(penloader->XDisplay(),
-                _gc,
-                (GCForeground
-                 | GCFunction
-                 | GCLineWidth
-                 | GCSubwindowMode),
-                &gcv);
-    }
+  if (!_item || _dirty) {
+    PenCacheKey key;
+    key.screen = _screen;
+    key.pixel = _color.pixel(_screen);
+    key.function = _function;
+    key.linewidth = _linewidth;
+    key.subwindow = _subwindow;
+
+    // find the new GC before releasing the old one, so that an
+    // unchanged GC is not freed
+    PenCacheItem *item = pencache->find(key);
+    if (_item)
+      pencache->release(_item);
+    _item = item;
     _dirty = false;
   }
-  assert(_gc != 0);
-  return _gc;
+  assert(_item != 0 && _item->gc != 0);
+  return _item->gc;
 }
 
 XftDraw *bt::Pen::xftDraw(Drawable drawable) const
-{
-#ifdef XFT
-  if (!_xftdraw) {
-    const ScreenInfo &screeninfo = penloader->display().screenInfo(_screen);
-    _xftdraw = XftDrawCreate(penloader->XDisplay(),
-                             drawable,
-                             screeninfo.visual(),
-                             screeninfo.colormap());
-  } else if (XftDrawDrawable(_xftdraw) != drawable) {
-    XftDrawChange(_xftdraw, drawable);
-  }
-  assert(_xftdraw != 0);
-  return _xftdraw;
-#else
-  return 0;
-#endif
-}
-
+{ return pencache->xftDraw(_screen, drawable); }
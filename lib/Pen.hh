@@ -34,9 +34,35 @@ namespace bt {
 
   // forward declarations
   class Display;
+  struct PenCacheItem;
 
   class Pen : public NoCopy {
   public:
+    /*
+      GCs are shared by all Pens with the same screen, color,
+      function, line width and subwindow mode, and are reference
+      counted.  Unused GCs are kept for reuse, up to a small limit.
+      Code that changes other GC values with XChangeGC() and friends
+      must restore them before the Pen is used again.
+    */
+    static void clearCache(void);
+
+    /*
+      Returns the number of times gc() found a shared GC, and the
+      number of times it had to create one.
+    */
+    static unsigned long cacheHits(void);
+    static unsigned long cacheMisses(void);
+
+    /*
+      XftDraws are cached per drawable and shared by all Pens.  Frees
+      the XftDraw for the drawable, if any.  This must be called
+      before the drawable is destroyed;
+      bt::Application::removeEventHandler() does this for all windows
+      with an event handler.
+    */
+    static void releaseXftDraw(Drawable drawable);
+
     Pen(unsigned int screen_);
     Pen(unsigned int screen_, const Color &color_);
     ~Pen(void);
@@ -66,8 +92,7 @@ namespace bt {
     int _subwindow;
 
     mutable bool _dirty;
-    mutable GC _gc;
-    mutable XftDraw *_xftdraw;
+    mutable PenCacheItem *_item;
   };
 
 } // namespace bt
@@ -27,14 +27,16 @@
 #include "PixmapCache.hh"
 #include "Display.hh"
 #include "Image.hh"
+#include "Pen.hh"
 #include "Texture.hh"
+#include "XIDTable.hh"
 
 #include <X11/Xlib.h>
 #include <assert.h>
 #include <cstdio>
 
-#include <algorithm>
 #include <list>
+#include <vector>
 
 // #define PIXMAPCACHE_DEBUG
 
@@ -51,49 +53,99 @@ namespace bt {
                 unsigned int width, unsigned int height,
                 Pixmap old_pixmap = 0ul);
     void release(Pixmap pixmap);
+    Pixmap tile(Pixmap pixmap) const;
 
     void clear(bool force);
+    void trim(void);
 
     struct CacheItem {
       const Texture texture;
       const unsigned int screen;
       const unsigned int width;
       const unsigned int height;
+      const bool tiled;
       Pixmap pixmap;
+      Pixmap tile;
+      unsigned int tile_width;
+      unsigned int tile_height;
+      unsigned long bytes;
       unsigned int count;
 
       inline CacheItem(void)
-        : screen(~0u), width(0u), height(0u),
-          pixmap(0ul), count(0u)
+        : screen(~0u), width(0u), height(0u), tiled(false),
+          pixmap(0ul), tile(0ul), tile_width(0u), tile_height(0u),
+          bytes(0ul), count(0u)
       { }
       inline CacheItem(const unsigned int s, const Texture &t,
-                       const unsigned int w, const unsigned int h)
-        : texture(t), screen(s), width(w), height(h),
-          pixmap(0ul), count(1u)
+                       const unsigned int w, const unsigned int h,
+                       const bool tl)
+        : texture(t), screen(s), width(w), height(h), tiled(tl),
+          pixmap(0ul), tile(0ul), tile_width(0u), tile_height(0u),
+          bytes(0ul), count(1u)
       { }
-
-      inline bool operator==(const CacheItem &x) const {
-        return texture == x.texture &&
-                screen == x.screen &&
-                 width == x.width &&
-                height == x.height;
-      }
     };
 
-    struct PixmapMatch {
-      inline PixmapMatch(Pixmap p)
-        : pixmap(p)
+    /*
+      Index key for a cache item.  Comparing keys only compares
+      integers; items with the same key still need their textures
+      compared, but this is rare.
+    */
+    struct CacheKey {
+      unsigned long hash;
+      unsigned int screen;
+      unsigned int width;
+      unsigned int height;
+      bool tiled;
+
+      inline CacheKey(const CacheItem &item)
+        : hash(textureHash(item.texture)), screen(item.screen),
+          width(item.width), height(item.height), tiled(item.tiled)
       { }
-      inline bool operator()(const RealPixmapCache::CacheItem& item) const
-      { return item.pixmap == pixmap; }
 
-      const Pixmap pixmap;
+      inline bool operator==(const CacheKey &x) const {
+        return (hash == x.hash && screen == x.screen && width == x.width
+                && height == x.height && tiled == x.tiled);
+      }
+      inline size_t bucket(size_t mask) const {
+        size_t h = hash;
+        h = (h * 31u) + screen;
+        h = (h * 31u) + width;
+        h = (h * 31u) + height;
+        h = (h * 31u) + tiled;
+        return (h ^ (h >> 16)) & mask;
+      }
     };
 
+    unsigned long pixmapSize(unsigned int screen,
+                             unsigned int width, unsigned int height) const;
+    void erase(const CacheItem &item);
+
     const Display &_display;
 
+    // bits per pixel and scanline pad for each depth, indexed by depth
+    std::vector<std::pair<unsigned int, unsigned int> > formats;
+
+    /*
+      Items are kept in most recently used order; items are moved to
+      the front when found or released.
+    */
     typedef std::list<CacheItem> Cache;
     Cache cache;
+
+    /*
+      Items are indexed by key in a hash table with chained buckets.
+      The table doubles when it holds more items than buckets, so
+      lookups take the same time however many pixmaps are cached.
+    */
+    typedef std::vector<std::pair<CacheKey, Cache::iterator> > KeyBucket;
+    std::vector<KeyBucket> keys;
+    size_t key_count;
+    Cache::iterator findKey(const CacheKey &key, const Texture &texture);
+    void insertKey(const CacheKey &key, Cache::iterator it);
+    void eraseKey(const CacheItem &item);
+
+    typedef XIDTable<Cache::iterator> PixmapIndex;
+    PixmapIndex pixmaps;
   };
 
 
@@ -119,14 +171,51 @@ namespace bt {
 
 
 bt::RealPixmapCache::RealPixmapCache(const Display &display)
-  : _display(display)
-{ }
+  : _display(display), keys(64), key_count(0)
+{
+  int count = 0;
+  XPixmapFormatValues *values = XListPixmapFormats(_display.XDisplay(),
+                                                   &count);
+  for (int i = 0; i < count; ++i) {
+    const unsigned int depth = values[i].depth;
+    if (formats.size() <= depth)
+      formats.resize(depth + 1, std::make_pair(0u, 0u));
+    formats[depth] = std::make_pair(values[i].bits_per_pixel,
+                                    values[i].scanline_pad);
+  }
+  if (values)
+    XFree(values);
+}
 
 
 bt::RealPixmapCache::~RealPixmapCache(void)
 { clear(true); }
 
 
+/*
+  Returns the number of bytes the X server uses for a pixmap of the
+  given size, based on the pixmap format for the screen depth.
+*/
+unsigned long bt::RealPixmapCache::pixmapSize(unsigned int screen,
+                                              unsigned int width,
+                                              unsigned int height) const {
+  const unsigned int depth = _display.screenInfo(screen).depth();
+  unsigned int bpp = 0, pad = 0;
+  if (depth < formats.size()) {
+    bpp = formats[depth].first;
+    pad = formats[depth].second;
+  }
+  if (bpp == 0)
+    bpp = depth <= 8 ? 8 : (depth <= 16 ? 16 : 32);
+  if (pad == 0)
+    pad = bpp;
+
+  const unsigned long bits_per_line =
+    ((static_cast<unsigned long>(width) * bpp + pad - 1) / pad) * pad;
+  return (bits_per_line / 8) * height;
+}
+
+
 Pixmap bt::RealPixmapCache::find(unsigned int screen,
                                  const Texture &texture,
                                  unsigned int width, unsigned int height,
@@ -139,14 +228,30 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
   if (texture.texture() == Texture::Parent_Relative)
     return ParentRelative;
 
+  // textures that do not change along one axis are rendered as a
+  // strip, shared by all sizes along that axis
+  TextureStrip strip;
+  bool tiled = false;
+  if (textureStrip(texture, strip)) {
+    if (strip.repeat_x && width > strip.size) {
+      width = strip.stripSize(width);
+      tiled = true;
+    } else if (!strip.repeat_x && height > strip.size) {
+      height = strip.stripSize(height);
+      tiled = true;
+    }
+  }
+
   Pixmap p;
   // find one in the cache
-  CacheItem item(screen, texture, width, height);
-  Cache::iterator it = std::find(cache.begin(), cache.end(), item);
+  CacheItem item(screen, texture, width, height, tiled);
+  const CacheKey key(item);
+  Cache::iterator it = findKey(key, texture);
 
   if (it != cache.end()) {
     // found
     ++(it->count);
+    cache.splice(cache.begin(), cache, it);
 
     p = it->pixmap;
 
@@ -156,11 +261,30 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
 #endif // PIXMAPCACHE_DEBUG
   } else {
     Image image(width, height);
-    p = image.render(_display, screen, texture);
+    // strips are small and are copied into a tile right away, so
+    // only full size pixmaps are rendered in the background
+    p = image.render(_display, screen, texture, !tiled);
 
     if (p) {
       item.pixmap = p;
 
+      if (tiled) {
+        // copy the repeated part of the strip into a pixmap of its own,
+        // to be used as a tile
+        item.tile_width = strip.repeat_x ? strip.period : width;
+        item.tile_height = strip.repeat_x ? height : strip.period;
+        item.tile =
+          XCreatePixmap(_display.XDisplay(),
+                        _display.screenInfo(screen).rootWindow(),
+                        item.tile_width, item.tile_height,
+                        _display.screenInfo(screen).depth());
+        Pen pen(screen, texture.color1());
+        XCopyArea(_display.XDisplay(), p, item.tile, pen.gc(),
+                  strip.repeat_x ? strip.offset : 0,
+                  strip.repeat_x ? 0 : strip.offset,
+                  item.tile_width, item.tile_height, 0, 0);
+      }
+
 #ifdef PIXMAPCACHE_DEBUG
       fprintf(stderr,
               gettext("bt::PixmapCache: add %08lx %4ux%4u\n"
@@ -168,14 +292,18 @@ Pixmap bt::RealPixmapCache::find(unsigned int screen,
               p, width, height, mem_usage, maxmem_usage);
 #endif // PIXMAPCACHE_DEBUG
 
+      // keep track of memory usage server side
+      item.bytes = pixmapSize(screen, width, height);
+      if (item.tile)
+        item.bytes += pixmapSize(screen, item.tile_width, item.tile_height);
+      mem_usage += item.bytes;
+
       cache.push_front(item);
+      insertKey(key, cache.begin());
+      pixmaps[p] = cache.begin();
 
-      // keep track of memory usage server side
-      const unsigned long mem =
-        ( ( width * height ) * (_display.screenInfo(screen).depth() / 8 ) );
-      mem_usage += mem;
       if (mem_usage > maxmem_usage)
-        clear(false);
+        trim();
 
 #ifdef PIXMAPCACHE_DEBUG
       if (mem_usage > maxmem_usage) {
@@ -196,12 +324,14 @@ void bt::RealPixmapCache::release(Pixmap pixmap) {
   if (!pixmap || pixmap == ParentRelative)
     return;
 
-  Cache::iterator it = std::find_if(cache.begin(), cache.end(),
-                                    PixmapMatch(pixmap));
-  assert(it != cache.end() && it->count > 0);
+  Cache::iterator * const pit = pixmaps.find(pixmap);
+  assert(pit != 0);
+  Cache::iterator it = *pit;
+  assert(it->count > 0);
 
   // decrement the refcount
   --(it->count);
+  cache.splice(cache.begin(), cache, it);
 
 #ifdef PIXMAPCACHE_DEBUG
   fprintf(stderr, gettext("bt::PixmapCache: rel %08lx %4ux%4u, count %4u\n"),
@@ -210,6 +340,111 @@ void bt::RealPixmapCache::release(Pixmap pixmap) {
 }
 
 
+Pixmap bt::RealPixmapCache::tile(Pixmap pixmap) const {
+  if (!pixmap || pixmap == ParentRelative)
+    return None;
+
+  const Cache::iterator * const it = pixmaps.find(pixmap);
+  return it ? (*it)->tile : None;
+}
+
+
+bt::RealPixmapCache::Cache::iterator
+bt::RealPixmapCache::findKey(const CacheKey &key, const Texture &texture) {
+  const KeyBucket &bucket = keys[key.bucket(keys.size() - 1)];
+  KeyBucket::const_iterator it = bucket.begin(), end = bucket.end();
+  for (; it != end; ++it) {
+    if (it->first == key && it->second->texture == texture)
+      return it->second;
+  }
+  return cache.end();
+}
+
+
+void bt::RealPixmapCache::insertKey(const CacheKey &key, Cache::iterator it) {
+  if (key_count >= keys.size()) {
+    std::vector<KeyBucket> old(keys.size() * 2);
+    old.swap(keys);
+    const size_t mask = keys.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+      KeyBucket::const_iterator e = old[i].begin(), end = old[i].end();
+      for (; e != end; ++e)
+        keys[e->first.bucket(mask)].push_back(*e);
+    }
+  }
+  keys[key.bucket(keys.size() - 1)].push_back(std::make_pair(key, it));
+  ++key_count;
+}
+
+
+void bt::RealPixmapCache::eraseKey(const CacheItem &item) {
+  const CacheKey key(item);
+  KeyBucket &bucket = keys[key.bucket(keys.size() - 1)];
+  KeyBucket::iterator it = bucket.begin(), end = bucket.end();
+  for (; it != end; ++it) {
+    if (&*it->second == &item) {
+      *it = bucket.back();
+      bucket.pop_back();
+      --key_count;
+      return;
+    }
+  }
+}
+
+
+void bt::RealPixmapCache::erase(const CacheItem &item) {
+#ifdef PIXMAPCACHE_DEBUG
+  fprintf(stderr, gettext("bt::PixmapCache: fre %08lx %4ux%4u\n"),
+          item.pixmap, item.width, item.height);
+#endif // PIXMAPCACHE_DEBUG
+
+  // keep track of memory usage server side
+  assert(item.bytes <= mem_usage);
+  mem_usage -= item.bytes;
+
+  // free pixmap
+  Image::cancelRender(item.pixmap);
+  XFreePixmap(_display.XDisplay(), item.pixmap);
+  if (item.tile)
+    XFreePixmap(_display.XDisplay(), item.tile);
+
+  // remove from the indexes, the caller removes it from the cache
+  eraseKey(item);
+  pixmaps.erase(item.pixmap);
+}
+
+
+/*
+  Frees the least recently used unused pixmaps until memory usage is
+  down to 3/4 of the limit, so that the next few new pixmaps do not
+  trigger another trim immediately.
+*/
+void bt::RealPixmapCache::trim(void) {
+  const unsigned long low_water = maxmem_usage - (maxmem_usage / 4);
+
+#ifdef PIXMAPCACHE_DEBUG
+  fprintf(stderr, gettext("bt::PixmapCache: trimming cache, %u entries\n"),
+          cache.size());
+#endif // PIXMAPCACHE_DEBUG
+
+  Cache::iterator it = cache.end();
+  while (it != cache.begin() && mem_usage > low_water) {
+    --it;
+    if (it->count != 0)
+      continue;
+    erase(*it);
+    it = cache.erase(it);
+  }
+
+#ifdef PIXMAPCACHE_DEBUG
+  fprintf(stderr,
+          gettext("bt::PixmapCache: trimmed, %u entries remain\n"
+                  "                 mem %8lu max %8lu\n"),
+          cache.size(), mem_usage, maxmem_usage);
+#endif // PIXMAPCACHE_DEBUG
+}
+
+
 void bt::RealPixmapCache::clear(bool force) {
   if (cache.empty())
     return; // nothing to do
@@ -231,22 +466,7 @@ void bt::RealPixmapCache::clear(bool force) {
       continue;
     }
 
-#ifdef PIXMAPCACHE_DEBUG
-    fprintf(stderr, gettext("bt::PixmapCache: fre %08lx %4ux%4u\n"),
-            it->pixmap, it->width, it->height);
-#endif // PIXMAPCACHE_DEBUG
-
-    // keep track of memory usage server side
-    const unsigned long mem =
-      ( ( it->width * it->height ) *
-        (_display.screenInfo(it->screen).depth() / 8 ) );
-    assert(mem <= mem_usage);
-    mem_usage -= mem;
-
-    // free pixmap
-    XFreePixmap(_display.XDisplay(), it->pixmap);
-
-    // remove from cache
+    erase(*it);
     it = cache.erase(it);
   }
 
@@ -282,5 +502,9 @@ void bt::PixmapCache::release(Pixmap pixmap)
 { realpixmapcache->release(pixmap); }
 
 
+Pixmap bt::PixmapCache::tile(Pixmap pixmap)
+{ return realpixmapcache->tile(pixmap); }
+
+
 void bt::PixmapCache::clearCache(void)
 { realpixmapcache->clear(false); }
@@ -39,7 +39,8 @@ namespace bt {
       megabyte (1024 kilobytes).
 
       When this limit is reached, the cache will automatically free
-      unused pixmaps to reduce the amount of server side memory used.
+      the least recently used unused pixmaps, until the amount of
+      server side memory used is back down to 3/4 of the limit.
 
       NOTE: This limit is not a hard limit.  The cache will never free
       a pixmap that is in use.  This means it is possible that the
@@ -54,7 +55,9 @@ namespace bt {
 
     /*
       Returns the current amount of memory in kilobytes used by the X
-      server for the pixmaps in the cache.
+      server for the pixmaps in the cache.  This is based on the
+      server's pixmap format (bits per pixel and scanline padding) for
+      the screen depth.
     */
     static unsigned long memoryUsage(void);
 
@@ -78,6 +81,18 @@ namespace bt {
     */
     static void release(Pixmap pixmap);
 
+    /*
+      Textures that do not change along one axis are rendered once as
+      a narrow strip (see bt::textureStrip()), which is shared by all
+      sizes along that axis.  For these, find() returns the strip and
+      this function returns the pixmap used to tile the interior of
+      the texture.  Returns None if the pixmap returned by find() is
+      a full size rendering.
+
+      bt::drawTexture() handles both cases.
+    */
+    static Pixmap tile(Pixmap pixmap);
+
     /*
       Free all unused pixmaps in the cache.
     */
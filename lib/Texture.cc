@@ -24,7 +24,9 @@
 
 #include "Texture.hh"
 #include "Display.hh"
+#include "Image.hh"
 #include "Pen.hh"
+#include "PixmapCache.hh"
 #include "Resource.hh"
 
 #include <algorithm>
@@ -213,6 +215,99 @@ bt::Texture bt::textureResource(const Display &display,
 }
 
 
+unsigned long bt::textureHash(const Texture &texture) {
+  const Color * const colors[5] = {
+    &texture.color1(), &texture.color2(), &texture.borderColor(),
+    &texture.lightColor(), &texture.shadowColor()
+  };
+  unsigned long hash = (texture.texture() * 31ul) + texture.borderWidth();
+  for (unsigned int i = 0; i < 5; ++i) {
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->red());
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->green());
+    hash = (hash * 31ul) + static_cast<unsigned long>(colors[i]->blue());
+  }
+  return hash;
+}
+
+
+bool bt::textureStrip(const Texture &texture, TextureStrip &strip) {
+  const unsigned long t = texture.texture();
+  if (!(t & Texture::Gradient) || (t & Texture::Parent_Relative))
+    return false;
+
+  // same precedence as bt::Image::render()
+  if (t & (Texture::Diagonal | Texture::Elliptic))
+    return false;
+  if (t & Texture::Horizontal) {
+    strip.repeat_x = false;
+  } else if (t & (Texture::Pyramid | Texture::Rectangle)) {
+    return false;
+  } else if (t & Texture::Vertical) {
+    strip.repeat_x = true;
+  } else if (t & (Texture::CrossDiagonal | Texture::PipeCross)) {
+    return false;
+  } else if (t & Texture::SplitVertical) {
+    strip.repeat_x = true;
+  } else {
+    return false;
+  }
+
+  // the bevel is drawn just inside the border
+  const unsigned int bw = texture.borderWidth();
+  if (t & (Texture::Raised | Texture::Sunken))
+    strip.edge = bw + 1;
+  else if (t & Texture::Border)
+    strip.edge = bw;
+  else
+    strip.edge = 0;
+
+  // interlacing darkens odd rows, so horizontal gradients repeat every
+  // other row.  the repeated part starts on an even row so that it
+  // can also be used as a window background
+  strip.period = (!strip.repeat_x && (t & Texture::Interlaced)) ? 2 : 1;
+  strip.offset = (strip.edge + strip.period - 1) / strip.period
+                 * strip.period;
+
+  // bt::Image only draws the bevel when the image is larger than 4
+  // times the border width, so the strip must be as well
+  strip.size = std::max(bw * 4 + 3, strip.offset + strip.period + strip.edge);
+  return true;
+}
+
+
+bool bt::setWindowBackground(unsigned int screen,
+                             const Texture &texture,
+                             Window window,
+                             Pixmap pixmap) {
+  const Pen pen(screen, texture.color1());
+  const unsigned long t = texture.texture();
+
+  if ((t & Texture::Gradient) && pixmap) {
+    // for textures rendered as a strip, the tile covers the inside
+    TextureStrip strip;
+    const Pixmap tile = PixmapCache::tile(pixmap);
+    if (tile && textureStrip(texture, strip)) {
+      XSetWindowBackgroundPixmap(pen.XDisplay(), window, tile);
+      return strip.edge == 0;
+    }
+
+    // a pixmap rendered in the background holds a placeholder until
+    // it is ready, drawTexture() arranges for the window to be exposed
+    // then
+    XSetWindowBackgroundPixmap(pen.XDisplay(), window, pixmap);
+    return !Image::isRendering(pixmap);
+  } else if (!(t & Texture::Solid)) {
+    XSetWindowBackgroundPixmap(pen.XDisplay(), window, None);
+    return false; // might be Parent_Relative or empty
+  }
+
+  XSetWindowBackground(pen.XDisplay(), window,
+                       texture.color1().pixel(screen));
+  return !(t & (Texture::Border | Texture::Raised | Texture::Sunken
+                | Texture::Interlaced));
+}
+
+
 void bt::drawTexture(unsigned int screen,
                      const Texture &texture,
                      Drawable drawable,
@@ -222,9 +317,64 @@ void bt::drawTexture(unsigned int screen,
   Pen pen(screen, texture.color1());
 
   if ((texture.texture() & Texture::Gradient) && pixmap) {
-    XCopyArea(pen.XDisplay(), pixmap, drawable, pen.gc(),
-              urect.x() - trect.x(), urect.y() - trect.y(),
-              urect.width(), urect.height(), urect.x(), urect.y());
+    TextureStrip strip;
+    const Pixmap tile = PixmapCache::tile(pixmap);
+    if (!tile || !textureStrip(texture, strip)) {
+      // redraw when the pixmap is ready, if rendered in the background
+      Image::exposeWhenRendered(pixmap, drawable);
+      XCopyArea(pen.XDisplay(), pixmap, drawable, pen.gc(),
+                urect.x() - trect.x(), urect.y() - trect.y(),
+                urect.width(), urect.height(), urect.x(), urect.y());
+      return;
+    }
+
+    // copy the edges from the strip...
+    const int e = static_cast<int>(strip.edge);
+    const unsigned int length =
+      strip.repeat_x ? trect.width() : trect.height();
+    const int size = static_cast<int>(strip.stripSize(length));
+    const int skip = static_cast<int>(length) - (e * 2);
+    Rect edges[2], inside;
+    if (strip.repeat_x) {
+      edges[0].setRect(trect.x(), trect.y(), e, trect.height());
+      edges[1].setRect(trect.right() - e + 1, trect.y(), e, trect.height());
+      inside.setRect(trect.x() + e, trect.y(), skip, trect.height());
+    } else {
+      edges[0].setRect(trect.x(), trect.y(), trect.width(), e);
+      edges[1].setRect(trect.x(), trect.bottom() - e + 1, trect.width(), e);
+      inside.setRect(trect.x(), trect.y() + e, trect.width(), skip);
+    }
+
+    for (unsigned int i = 0; i < 2; ++i) {
+      if (e == 0 || !edges[i].intersects(urect))
+        continue;
+      const Rect r = edges[i] & urect;
+      int sx = r.x() - trect.x(), sy = r.y() - trect.y();
+      if (i == 1) {
+        if (strip.repeat_x)
+          sx -= skip + e - (size - e);
+        else
+          sy -= skip + e - (size - e);
+      }
+      XCopyArea(pen.XDisplay(), pixmap, drawable, pen.gc(),
+                sx, sy, r.width(), r.height(), r.x(), r.y());
+    }
+
+    // ... and tile the inside
+    if (skip > 0 && inside.intersects(urect)) {
+      const Rect r = inside & urect;
+      XGCValues gcv;
+      gcv.fill_style = FillTiled;
+      gcv.tile = tile;
+      gcv.ts_x_origin = trect.x() + (strip.repeat_x ? strip.offset : 0);
+      gcv.ts_y_origin = trect.y() + (strip.repeat_x ? 0 : strip.offset);
+      XChangeGC(pen.XDisplay(), pen.gc(),
+                GCFillStyle | GCTile | GCTileStipXOrigin | GCTileStipYOrigin,
+                &gcv);
+      XFillRectangle(pen.XDisplay(), drawable, pen.gc(),
+                     r.x(), r.y(), r.width(), r.height());
+      XSetFillStyle(pen.XDisplay(), pen.gc(), FillSolid);
+    }
     return;
   } else if (!(texture.texture() & Texture::Solid)) {
     XClearArea(pen.XDisplay(), drawable,
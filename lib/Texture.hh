@@ -42,6 +42,57 @@ namespace bt {
                    const Rect &urect,
                    Pixmap pixmap = 0ul);
 
+  /*
+    Makes the texture the background of the window, so that the X
+    server repaints exposed areas itself.  Returns true if the
+    background is the whole texture; otherwise drawTexture() is still
+    needed for borders, bevels, the edges of a strip or a pixmap that
+    is still being rendered.  The pixmap must be the size of the
+    window.
+  */
+  bool setWindowBackground(unsigned int screen,
+                           const Texture &texture,
+                           Window window,
+                           Pixmap pixmap = 0ul);
+
+  /*
+    Vertical and split vertical gradients do not change along the x
+    axis, and horizontal gradients do not change along the y axis.
+    These textures are rendered as a strip that is 'size' pixels long
+    along that axis.  The first and last 'edge' pixels of the strip
+    hold the bevel and border of the texture, and the 'period' pixels
+    starting at 'offset' are repeated to fill everything in between.
+  */
+  struct TextureStrip {
+    bool repeat_x;
+    unsigned int size;
+    unsigned int edge;
+    unsigned int offset;
+    unsigned int period;
+
+    /*
+      Returns the length of the strip used for a texture that is
+      {length} pixels long.  Interlacing darkens odd rows, so the
+      strip has the same parity as the texture, to render the far edge
+      on the same rows.
+    */
+    inline unsigned int stripSize(unsigned int length) const
+    { return length > size ? size + (length - size) % period : length; }
+  };
+
+  /*
+    Returns true if the texture can be drawn from a strip, and fills
+    in the strip geometry.
+  */
+  bool textureStrip(const Texture &texture, TextureStrip &strip);
+
+  /*
+    Returns a hash of the texture, computed from its type, border width
+    and colors.  The hash does not depend on allocated pixel values, so
+    it is the same in every process.
+  */
+  unsigned long textureHash(const Texture &texture);
+
   /*
     If 'name.appearance' cannot be found, a flat solid texture in the
     defaultColor is returned; otherwise, the texture is read.  All
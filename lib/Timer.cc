@@ -25,6 +25,8 @@
 #include "Timer.hh"
 
 #include <sys/time.h>
+#include <assert.h>
+#include <time.h>
 
 
 bt::timeval::timeval(const ::timeval &t)
@@ -32,7 +34,7 @@ bt::timeval::timeval(const ::timeval &t)
 { }
 
 
-bool bt::timeval::operator<(const timeval &tv)
+bool bt::timeval::operator<(const timeval &tv) const
 { return tv_sec < tv.tv_sec || (tv_sec == tv.tv_sec && tv_usec < tv.tv_usec); }
 
 
@@ -85,26 +87,33 @@ bt::timeval bt::normalizeTimeval(const timeval &tm) {
 }
 
 
+bt::timeval bt::monotonicTime(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return timeval(ts.tv_sec, ts.tv_nsec / 1000);
+#endif
+  ::timeval tv;
+  gettimeofday(&tv, 0);
+  return tv;
+}
+
+
 bt::Timer::Timer(TimerQueueManager *m, TimeoutHandler *h) {
   manager = m;
   handler = h;
 
   recur = timing = false;
+  _index = ~0u;
 }
 
 
 bt::Timer::~Timer(void) {
-  if (timing)
+  if (timing || _index != ~0u)
     stop();
 }
 
 
-void printTime(const char *message, const bt::timeval &tv);
-
-void bt::Timer::adjustStartTime(const timeval &offset)
-{ _start += offset; }
-
-
 void bt::Timer::setTimeout(long t) {
   _timeout.tv_sec = t / 1000;
   _timeout.tv_usec = t % 1000;
@@ -117,14 +126,11 @@ void bt::Timer::setTimeout(const timeval &t)
 
 
 void bt::Timer::start(void) {
-  ::timeval s;
-  gettimeofday(&s, 0);
-  _start = s;
+  _start = monotonicTime();
 
-  if (!timing) {
-    timing = true;
-    manager->addTimer(this);
-  }
+  // the manager moves a running timer to its new endpoint
+  timing = true;
+  manager->addTimer(this);
 }
 
 
@@ -171,3 +177,70 @@ bool bt::Timer::shouldFire(const timeval &tm) const {
   return !((tm.tv_sec < end.tv_sec) ||
            (tm.tv_sec == end.tv_sec && tm.tv_usec < end.tv_usec));
 }
+
+
+void bt::TimerQueue::push(Timer *timer) {
+  if (timer->_index == ~0u) {
+    heap.push_back(timer);
+    timer->_index = heap.size() - 1;
+  }
+  siftUp(timer->_index);
+  siftDown(timer->_index);
+}
+
+
+void bt::TimerQueue::pop(void)
+{ release(heap.front()); }
+
+
+void bt::TimerQueue::release(Timer *timer) {
+  const size_t index = timer->_index;
+  if (index == ~0u)
+    return;
+  assert(index < heap.size() && heap[index] == timer);
+
+  timer->_index = ~0u;
+  Timer * const last = heap.back();
+  heap.pop_back();
+  if (last == timer)
+    return;
+
+  // move the last timer into the hole
+  place(last, index);
+  siftUp(index);
+  siftDown(last->_index);
+}
+
+
+void bt::TimerQueue::siftUp(size_t index) {
+  Timer * const timer = heap[index];
+  const timeval end = timer->endpoint();
+  while (index > 0) {
+    const size_t parent = (index - 1) / 2;
+    if (!(end < heap[parent]->endpoint()))
+      break;
+    place(heap[parent], index);
+    index = parent;
+  }
+  place(timer, index);
+}
+
+
+void bt::TimerQueue::siftDown(size_t index) {
+  Timer * const timer = heap[index];
+  const timeval end = timer->endpoint();
+  const size_t count = heap.size();
+  for (;;) {
+    size_t child = (index * 2) + 1;
+    if (child >= count)
+      break;
+    if (child + 1 < count
+        && heap[child + 1]->endpoint() < heap[child]->endpoint())
+      ++child;
+    if (!(heap[child]->endpoint() < end))
+      break;
+    place(heap[child], index);
+    index = child;
+  }
+  place(timer, index);
+}
@@ -28,7 +28,6 @@
 #include "Util.hh"
 
 #include <algorithm>
-#include <queue>
 #include <vector>
 
 // forward declare to avoid the header
@@ -48,7 +47,7 @@ namespace bt {
       : tv_sec(s), tv_usec(u)
     { }
 
-    bool operator<(const timeval &);
+    bool operator<(const timeval &) const;
     timeval operator+(const timeval &);
     timeval &operator+=(const timeval &tv);
     timeval operator-(const timeval &);
@@ -62,8 +61,15 @@ namespace bt {
 
   timeval normalizeTimeval(const timeval &tm);
 
+  /*
+    Returns the time from a clock that never jumps backwards, such as
+    CLOCK_MONOTONIC.  Timers are measured with this clock.
+  */
+  timeval monotonicTime(void);
+
   // forward declaration
   class TimerQueueManager;
+  class TimerQueue;
   class Timer;
 
   class TimeoutHandler {
@@ -80,6 +86,10 @@ namespace bt {
 
     timeval _start, _timeout;
 
+    // position in the TimerQueue, or ~0u when not queued
+    size_t _index;
+    friend class TimerQueue;
+
   public:
     Timer(TimerQueueManager *m, TimeoutHandler *h);
     virtual ~Timer(void);
@@ -96,10 +106,6 @@ namespace bt {
     inline const timeval &startTime(void) const
     { return _start; }
 
-    // adjust the start time by the given offset... this is done when
-    // the clock rolls back
-    void adjustStartTime(const timeval &offset);
-
     timeval timeRemaining(const timeval &tm) const;
     bool shouldFire(const timeval &tm) const;
     timeval endpoint(void) const;
@@ -110,7 +116,7 @@ namespace bt {
     void setTimeout(long t);
     void setTimeout(const timeval &t);
 
-    void start(void);  // manager acquires timer
+    void start(void);  // manager acquires timer, or reschedules it
     void stop(void);   // manager releases timer
     void halt(void);   // halts the timer
 
@@ -118,46 +124,36 @@ namespace bt {
     { return shouldFire(other.endpoint()); }
   };
 
-  template <class _Tp, class _Sequence, class _Compare>
-  class _timer_queue: protected std::priority_queue<_Tp, _Sequence, _Compare> {
+  /*
+    A binary heap of timers, the timer with the earliest endpoint at
+    the top.  Each timer knows its position in the heap, so timers
+    are removed and rescheduled in O(log n).
+  */
+  class TimerQueue: public NoCopy {
   public:
-    typedef std::priority_queue<_Tp, _Sequence, _Compare> _Base;
-
-    inline _timer_queue(void)
-      : _Base()
-    { }
-    inline ~_timer_queue(void)
-    { }
-
-    inline void release(const _Tp& value) {
-      _Base::c.erase(std::remove(_Base::c.begin(), _Base::c.end(), value),
-                     _Base::c.end());
-      // after removing the item we need to make the heap again
-      std::make_heap(_Base::c.begin(), _Base::c.end(), _Base::comp);
-    }
     inline bool empty(void) const
-    { return _Base::empty(); }
+    { return heap.empty(); }
     inline size_t size(void) const
-    { return _Base::size(); }
-    inline void push(const _Tp& value)
-    { _Base::push(value); }
-    inline void pop(void)
-    { _Base::pop(); }
-    inline const _Tp& top(void) const
-    { return _Base::top(); }
+    { return heap.size(); }
+    inline Timer *top(void) const
+    { return heap.front(); }
+    inline bool contains(const Timer *timer) const
+    { return timer->_index != ~0u; }
+
+    // adds the timer, or moves it if its endpoint has changed
+    void push(Timer *timer);
+    void pop(void);
+    void release(Timer *timer);
+
   private:
-    // no copying!
-    _timer_queue(const _timer_queue&);
-    _timer_queue& operator=(const _timer_queue&);
-  };
+    void siftUp(size_t index);
+    void siftDown(size_t index);
+    inline void place(Timer *timer, size_t index)
+    { heap[index] = timer; timer->_index = index; }
 
-  struct TimerLessThan {
-    inline bool operator()(const Timer* const l, const Timer* const r) const
-    { return *r < *l; }
+    std::vector<Timer*> heap;
   };
 
-  typedef _timer_queue<Timer*, std::vector<Timer*>, TimerLessThan> TimerQueue;
-
   class TimerQueueManager {
   public:
     inline virtual ~TimerQueueManager() { }
@@ -25,6 +25,8 @@
 #include "Unicode.hh"
 
 #include <algorithm>
+#include <cctype>
+#include <cstring>
 
 #include <errno.h>
 #include <iconv.h>
@@ -41,6 +43,26 @@ namespace bt {
   static const iconv_t invalid = reinterpret_cast<iconv_t>(-1);
   static std::string codeset;
 
+  /*
+    The descriptors between the locale codeset and UTF-32 are opened
+    once by hasUnicode() and reused for every conversion.  When the
+    locale codeset is UTF-8, iconv is not used at all.
+  */
+  static iconv_t to_unicode = invalid;
+  static iconv_t from_unicode = invalid;
+  static bool utf8_codeset = false;
+
+  static bool is_utf8(const std::string &name) {
+    std::string n;
+    std::string::const_iterator it = name.begin();
+    const std::string::const_iterator end = name.end();
+    for (; it != end; ++it) {
+      if (*it != '-' && *it != '_')
+        n += toupper(*it);
+    }
+    return n == "UTF8";
+  }
+
   static unsigned int byte_swap(unsigned int c) {
     wchar_t ret;
     int x = sizeof(wchar_t);
@@ -77,12 +99,13 @@ namespace bt {
   }
 
   template <typename _Source, typename _Target>
-  static void convert(const char *target, const char *source,
-                      const _Source &in, _Target &out) {
-    iconv_t cd = iconv_open(target, source);
+  static void convert(iconv_t cd, const _Source &in, _Target &out) {
     if (cd == invalid)
       return;
 
+    // reset the shift state left by the previous conversion
+    iconv(cd, 0, 0, 0, 0);
+
     char *inp =
       reinterpret_cast<char *>
       (const_cast<typename _Source::value_type *>(in.data()));
@@ -110,7 +133,7 @@ namespace bt {
             const typename _Source::size_type off = in_size - in_bytes + 1;
             inp =
               reinterpret_cast<char *>
-              (const_cast<typename _Source::value_type *>(in.data()));
+              (const_cast<typename _Source::value_type *>(in.data())) + off;
             in_bytes = in_size - off;
             break;
           }
@@ -129,14 +152,119 @@ namespace bt {
         default:
           perror("iconv");
           out = _Target();
-          iconv_close(cd);
           return;
         }
       }
     } while (in_bytes != 0);
 
     out.resize((out_size - out_bytes) / sizeof(typename _Target::value_type));
-    iconv_close(cd);
+  }
+
+  // bytes with the high bit set, in every byte of an unsigned long
+  static const unsigned long high_bits = (~0ul / 0xff) * 0x80;
+
+  /*
+    Decodes UTF-8 to native endian UTF-32.  Invalid and overlong
+    sequences are skipped.
+  */
+  static void utf8_to_utf32(const std::string &in, ustring &out) {
+    out.resize(in.size());
+    if (in.empty())
+      return;
+
+    const unsigned char *p =
+      reinterpret_cast<const unsigned char *>(in.data());
+    const unsigned char * const end = p + in.size();
+    Uchar *o = &out[0];
+
+    while (p != end) {
+      // copy runs of ASCII a word at a time
+      while (static_cast<size_t>(end - p) >= sizeof(unsigned long)) {
+        unsigned long word;
+        memcpy(&word, p, sizeof(word));
+        if (word & high_bits)
+          break;
+        for (unsigned int i = 0; i < sizeof(word); ++i)
+          *o++ = p[i];
+        p += sizeof(word);
+      }
+      if (p == end)
+        break;
+
+      Uchar c = *p++;
+      if (c < 0x80) {
+        *o++ = c;
+        continue;
+      }
+
+      int n;
+      Uchar min;
+      if ((c & 0xe0) == 0xc0) {
+        n = 1;
+        c &= 0x1f;
+        min = 0x80;
+      } else if ((c & 0xf0) == 0xe0) {
+        n = 2;
+        c &= 0x0f;
+        min = 0x800;
+      } else if ((c & 0xf8) == 0xf0) {
+        n = 3;
+        c &= 0x07;
+        min = 0x10000;
+      } else {
+        continue; // not a lead byte
+      }
+
+      if (end - p < n)
+        break; // truncated sequence
+
+      int i = 0;
+      for (; i < n && (p[i] & 0xc0) == 0x80; ++i)
+        c = (c << 6) | (p[i] & 0x3f);
+      if (i != n)
+        continue; // resynchronize on the next byte
+      p += n;
+
+      if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+        continue;
+      *o++ = c;
+    }
+
+    out.resize(o - &out[0]);
+  }
+
+  /*
+    Encodes native endian UTF-32 to UTF-8.  Characters outside the
+    Unicode range and surrogates are skipped.
+  */
+  static void utf32_to_utf8(const ustring &in, std::string &out) {
+    out.resize(in.size() * 4);
+    std::string::size_type o = 0;
+
+    ustring::const_iterator it = in.begin();
+    const ustring::const_iterator end = in.end();
+    for (; it != end; ++it) {
+      const Uchar c = *it;
+      if (c < 0x80) {
+        out[o++] = c;
+      } else if (c < 0x800) {
+        out[o++] = 0xc0 | (c >> 6);
+        out[o++] = 0x80 | (c & 0x3f);
+      } else if (c < 0x10000) {
+        if (c >= 0xd800 && c <= 0xdfff)
+          continue;
+        out[o++] = 0xe0 | (c >> 12);
+        out[o++] = 0x80 | ((c >> 6) & 0x3f);
+        out[o++] = 0x80 | (c & 0x3f);
+      } else if (c < 0x110000) {
+        out[o++] = 0xf0 | (c >> 18);
+        out[o++] = 0x80 | ((c >> 12) & 0x3f);
+        out[o++] = 0x80 | ((c >> 6) & 0x3f);
+        out[o++] = 0x80 | (c & 0x3f);
+      }
+    }
+
+    out.resize(o);
   }
 
 } // namespace bt
@@ -166,6 +294,8 @@ bool bt::hasUnicode() {
   }
 #endif // HAVE_NL_LANGINFO
 
+  utf8_codeset = is_utf8(codeset);
+
   struct {
     const char *to;
     const char *from;
@@ -176,16 +306,27 @@ bool bt::hasUnicode() {
     { codeset.c_str(), "UTF-32" },
   };
   static const int conversions_count = 4;
+  iconv_t descriptors[conversions_count];
 
-  for (int x = 0; x < conversions_count; ++x) {
-    iconv_t cd = iconv_open(conversions[x].to, conversions[x].from);
+  int x;
+  for (x = 0; x < conversions_count; ++x) {
+    descriptors[x] = iconv_open(conversions[x].to, conversions[x].from);
 
-    if (cd == invalid) {
+    if (descriptors[x] == invalid) {
       has_unicode = false;
       break;
     }
+  }
 
-    iconv_close(cd);
+  if (has_unicode) {
+    // keep the locale descriptors, UTF-8 is converted natively
+    to_unicode = descriptors[0];
+    from_unicode = descriptors[3];
+    iconv_close(descriptors[1]);
+    iconv_close(descriptors[2]);
+  } else {
+    while (x-- > 0)
+      iconv_close(descriptors[x]);
   }
 
   done = true;
@@ -200,8 +341,12 @@ bt::ustring bt::toUnicode(const std::string &string) {
     std::copy(string.begin(), string.end(), ret.begin());
     return ret;
   }
+  if (utf8_codeset) {
+    utf8_to_utf32(string, ret);
+    return ret;
+  }
   ret.reserve(string.size());
-  convert("UTF-32", codeset.c_str(), string, ret);
+  convert(to_unicode, string, ret);
   return native_endian(ret);
 }
 
@@ -213,8 +358,12 @@ std::string bt::toLocale(const bt::ustring &string) {
     std::copy(string.begin(), string.end(), ret.begin());
     return ret;
   }
+  if (utf8_codeset) {
+    utf32_to_utf8(string, ret);
+    return ret;
+  }
   ret.reserve(string.size());
-  convert(codeset.c_str(), "UTF-32", add_bom(string), ret);
+  convert(from_unicode, add_bom(string), ret);
   return ret;
 }
 
@@ -222,8 +371,7 @@ std::string bt::toUtf8(const bt::ustring &utf32) {
   std::string ret;
   if (!hasUnicode())
     return ret;
-  ret.reserve(utf32.size());
-  convert("UTF-8", "UTF-32", add_bom(utf32), ret);
+  utf32_to_utf8(utf32, ret);
   return ret;
 }
 
@@ -231,7 +379,6 @@ bt::ustring bt::toUtf32(const std::string &utf8) {
   ustring ret;
   if (!hasUnicode())
     return ret;
-  ret.reserve(utf8.size());
-  convert("UTF-32", "UTF-8", utf8, ret);
-  return native_endian(ret);
+  utf8_to_utf32(utf8, ret);
+  return ret;
 }
@@ -27,6 +27,7 @@
 #include <X11/Xutil.h>
 
 #include "Util.hh"
+#include "Application.hh"
 
 #include <algorithm>
 
@@ -37,6 +38,7 @@
 #include <assert.h>
 #include <cctype>
 #include <errno.h>
+#include <signal.h>
 #if defined(__EMX__)
 #  include <process.h>
 #endif // __EMX__
@@ -147,6 +149,7 @@ void bt::bexec(const std::string& command, const std::string& displaystring) {
 #ifndef __QNXTO__ // apparently, setsid interferes with signals on QNX
     setsid();
 #endif
+    Application::restoreSignalMask();
     int ret = putenv(const_cast<char *>(displaystring.c_str()));
     assert(ret != -1);
     std::string cmd = "exec ";
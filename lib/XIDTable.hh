@@ -0,0 +1,160 @@
+// -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; -*-
+// XIDTable.hh for Blackbox - an X11 Window manager
+// Copyright (c) 2001 - 2005 Sean 'Shaleh' Perry <shaleh@debian.org>
+// Copyright (c) 1997 - 2000, 2002 - 2005
+//         Bradley T Hughes <bhughes at trolltech.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef __XIDTable_hh
+#define __XIDTable_hh
+
+#include "Util.hh"
+
+#include <assert.h>
+
+namespace bt {
+
+  /*
+    A hash table keyed by X resource id.  Entries are stored inline
+    in a single array and collisions are resolved by linear probing,
+    so a lookup usually touches one cache line instead of walking the
+    nodes of a std::map.  The id None (0) marks an empty slot and
+    cannot be used as a key.  T must be default constructible;
+    pointers returned by find() are invalidated by the next insertion.
+  */
+  template <typename T>
+  class XIDTable : public NoCopy {
+  public:
+    inline XIDTable(void)
+      : entries(0), mask(0), count(0)
+    { }
+    inline ~XIDTable(void)
+    { delete [] entries; }
+
+    inline size_t size(void) const
+    { return count; }
+    inline bool empty(void) const
+    { return count == 0; }
+
+    /*
+      Returns the value stored for {id}, or 0 if {id} is not in the
+      table.
+    */
+    T *find(XID id) const {
+      if (!entries)
+        return 0;
+      for (size_t i = slot(id); entries[i].id != None; i = (i + 1) & mask) {
+        if (entries[i].id == id)
+          return &entries[i].value;
+      }
+      return 0;
+    }
+
+    /*
+      Returns the value stored for {id}, inserting a default
+      constructed value if {id} is not in the table.
+    */
+    T &operator[](XID id) {
+      assert(id != None);
+      if ((count + 1) * 4 > (mask + 1) * 3)
+        resize(entries ? (mask + 1) * 2 : 64);
+      size_t i = slot(id);
+      for (; entries[i].id != None; i = (i + 1) & mask) {
+        if (entries[i].id == id)
+          return entries[i].value;
+      }
+      entries[i].id = id;
+      ++count;
+      return entries[i].value;
+    }
+
+    /*
+      Removes {id} from the table.  Entries following it in the probe
+      sequence are shifted back, so no tombstones are left behind.
+    */
+    void erase(XID id) {
+      if (!entries || id == None)
+        return;
+      size_t i = slot(id);
+      for (; entries[i].id != id; i = (i + 1) & mask) {
+        if (entries[i].id == None)
+          return;
+      }
+      for (size_t j = (i + 1) & mask; entries[j].id != None;
+           j = (j + 1) & mask) {
+        // move entry j into the hole unless its home slot lies
+        // cyclically in (i, j]
+        const size_t k = slot(entries[j].id);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+          continue;
+        entries[i] = entries[j];
+        i = j;
+      }
+      entries[i].id = None;
+      entries[i].value = T();
+      --count;
+    }
+
+    void clear(void) {
+      delete [] entries;
+      entries = 0;
+      mask = count = 0;
+    }
+
+  private:
+    struct Entry {
+      XID id;
+      T value;
+      inline Entry(void) : id(None), value() { }
+    };
+
+    Entry *entries;
+    size_t mask, count;
+
+    inline size_t slot(XID id) const {
+      // X servers hand out ids sequentially from a per-client base
+      // that only differs in the high bits; mix them into the low
+      // bits so that the windows of different clients do not collide
+      unsigned int h = static_cast<unsigned int>(id);
+      h = ((h >> 16) ^ h) * 0x45d9f3bu;
+      h = ((h >> 16) ^ h) * 0x45d9f3bu;
+      return ((h >> 16) ^ h) & mask;
+    }
+
+    void resize(size_t capacity) {
+      Entry *old = entries;
+      const size_t old_capacity = entries ? mask + 1 : 0;
+      entries = new Entry[capacity];
+      mask = capacity - 1;
+      for (size_t n = 0; n < old_capacity; ++n) {
+        if (old[n].id == None)
+          continue;
+        size_t i = slot(old[n].id);
+        while (entries[i].id != None)
+          i = (i + 1) & mask;
+        entries[i] = old[n];
+      }
+      delete [] old;
+    }
+  };
+
+} // namespace bt
+
+#endif // __XIDTable_hh
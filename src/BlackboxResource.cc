@@ -67,6 +67,18 @@ void BlackboxResource::load(Blackbox& blackbox) {
   if (maxcolors != ~0u)
     bt::Image::setMaximumColors(maxcolors);
 
+  bt::Image::setDiskCacheLimit(res.read("session.diskCacheLimit",
+                                        "Session.DiskCacheLimit",
+                                        bt::Image::diskCacheLimit()));
+
+  bt::Image::setRenderThreads(res.read("session.renderThreads",
+                                       "Session.RenderThreads",
+                                       0u));
+
+  blackbox.setSlowEventThreshold(res.read("session.slowEventThreshold",
+                                          "Session.SlowEventThreshold",
+                                          0u));
+
   double_click_interval = res.read("session.doubleClickInterval",
                                    "Session.DoubleClickInterval",
                                    250l);
@@ -249,6 +261,12 @@ void BlackboxResource::save(Blackbox& blackbox) {
 
   res.write("session.maximumColors",  bt::Image::maximumColors());
 
+  res.write("session.diskCacheLimit", bt::Image::diskCacheLimit());
+
+  res.write("session.renderThreads", bt::Image::renderThreads());
+
+  res.write("session.slowEventThreshold", blackbox.slowEventThreshold());
+
   res.write("session.doubleClickInterval", double_click_interval);
 
   res.write("session.autoRaiseDelay", ((auto_raise_delay.tv_sec * 1000ul) +
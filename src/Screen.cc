@@ -439,8 +439,10 @@ BScreen::~BScreen(void) {
 
   bt::PixmapCache::release(geom_pixmap);
 
-  if (geom_window != None)
+  if (geom_window != None) {
+    bt::Pen::releaseXftDraw(geom_window);
     XDestroyWindow(_blackbox->XDisplay(), geom_window);
+  }
   if (empty_window != None)
     XDestroyWindow(_blackbox->XDisplay(), empty_window);
 
@@ -49,6 +49,7 @@ Slit::Slit(BScreen *scr) {
 
   display = screen->screenInfo().display().XDisplay();
   frame.window = frame.pixmap = None;
+  frame.background = false;
 
   timer = new bt::Timer(blackbox, this);
   timer->setTimeout(blackbox->resource().autoRaiseDelay());
@@ -152,14 +153,16 @@ void Slit::addClient(Window w) {
   clientList.push_back(client);
 
   blackbox->insertEventHandler(client->client_window, this);
-  blackbox->insertEventHandler(client->icon_window, this);
+  if (client->icon_window != None)
+    blackbox->insertEventHandler(client->icon_window, this);
   reconfigure();
 }
 
 
 void Slit::removeClient(SlitClient *client, bool remap) {
   blackbox->removeEventHandler(client->client_window);
-  blackbox->removeEventHandler(client->icon_window);
+  if (client->icon_window != None)
+    blackbox->removeEventHandler(client->icon_window);
   clientList.remove(client);
 
   if (remap) {
@@ -249,11 +252,9 @@ void Slit::reconfigure(void) {
                           frame.rect.width(), frame.rect.height(),
                           frame.pixmap);
 /*** START: BBDOCK PATCH FOR DOCK APPS THAT USE ParentRelative **************/
-  if ((texture.texture() & bt::Texture::Gradient) && frame.pixmap)
-    XSetWindowBackgroundPixmap(display, frame.window, frame.pixmap);
-  else if ((texture.texture() & bt::Texture::Solid))
-    XSetWindowBackground(display, frame.window, 
-      texture.color1().pixel(screen->screenNumber()));
+  frame.background =
+    bt::setWindowBackground(screen->screenNumber(), texture,
+                            frame.window, frame.pixmap);
 /*** STOP: BBDOCK PATCH FOR DOCK APPS THAT USE ParentRelative ***************/
   XClearArea(display, frame.window, 0, 0,
              frame.rect.width(), frame.rect.height(), True);
@@ -588,6 +589,8 @@ void Slit::reparentNotifyEvent(const XReparentEvent * const event) {
 
 
 void Slit::exposeEvent(const XExposeEvent * const event) {
+  if (frame.background)
+    return; // the server has repainted the background
   bt::drawTexture(screen->screenNumber(),
                   screen->resource().slitStyle().slit,
                   frame.window,
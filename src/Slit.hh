@@ -56,6 +56,7 @@ private:
 
   struct SlitFrame {
     Pixmap pixmap;
+    bool background; // the window background is the whole texture
     Window window;
 
     int x_hidden, y_hidden;
@@ -152,6 +152,7 @@ Toolbar::Toolbar(BScreen *scrn) {
 
   frame.base = frame.slabel = frame.wlabel = frame.clk = frame.button =
  frame.pbutton = None;
+  frame.base_background = false;
 
   _screen->addStrut(&strut);
 
@@ -374,6 +375,9 @@ void Toolbar::reconfigure(void) {
     bt::PixmapCache::find(_screen->screenNumber(), style.toolbar,
                           frame.rect.width(), frame.rect.height(),
                           frame.base);
+  frame.base_background =
+    bt::setWindowBackground(_screen->screenNumber(), style.toolbar,
+                            frame.window, frame.base);
   frame.slabel =
     bt::PixmapCache::find(_screen->screenNumber(), style.slabel,
                           frame.slabel_rect.width(),
@@ -745,6 +749,21 @@ void Toolbar::leaveNotifyEvent(const XCrossingEvent * const /*unused*/) {
 
 
 void Toolbar::exposeEvent(const XExposeEvent * const event) {
+  if (event->window == frame.window) {
+    if (frame.base_background)
+      return;
+    bt::Rect t(0, 0, frame.rect.width(), frame.rect.height());
+    bt::Rect r(event->x, event->y, event->width, event->height);
+    bt::drawTexture(_screen->screenNumber(),
+                    _screen->resource().toolbarStyle().toolbar,
+                    frame.window, t, r & t, frame.base);
+    return;
+  }
+
+  // labels and buttons are redrawn whole, once for all rectangles
+  if (event->count > 0)
+    return;
+
   if (event->window == frame.clock) redrawClockLabel();
   else if (event->window == frame.workspace_label) redrawWorkspaceLabel();
   else if (event->window == frame.window_label) redrawWindowLabel();
@@ -752,13 +771,6 @@ void Toolbar::exposeEvent(const XExposeEvent * const event) {
   else if (event->window == frame.nsbutton) redrawNextWorkspaceButton();
   else if (event->window == frame.pwbutton) redrawPrevWindowButton();
   else if (event->window == frame.nwbutton) redrawNextWindowButton();
-  else if (event->window == frame.window) {
-    bt::Rect t(0, 0, frame.rect.width(), frame.rect.height());
-    bt::Rect r(event->x, event->y, event->width, event->height);
-    bt::drawTexture(_screen->screenNumber(),
-                    _screen->resource().toolbarStyle().toolbar,
-                    frame.window, t, r & t, frame.base);
-  }
 }
 
 
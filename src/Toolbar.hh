@@ -40,6 +40,7 @@ private:
   struct ToolbarFrame {
     unsigned long button_pixel, pbutton_pixel;
     Pixmap base, slabel, wlabel, clk, button, pbutton;
+    bool base_background; // the window background is the whole texture
     Window window, workspace_label, window_label, clock, psbutton, nsbutton,
       pwbutton, nwbutton;
 
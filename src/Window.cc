@@ -34,6 +34,7 @@
 #include "Workspace.hh"
 #include "blackbox.hh"
 
+#include <Image.hh>
 #include <Pen.hh>
 #include <PixmapCache.hh>
 #include <Unicode.hh>
@@ -1054,6 +1055,8 @@ BlackboxWindow::BlackboxWindow(Blackbox *b, Window w, BScreen *s) {
     frame.colormap = XCreateColormap(blackbox->XDisplay(),
                                      _screen->screenInfo().rootWindow(),
                                      frame.visual, AllocNone);
+    bt::Color::addColormap(_screen->screenNumber(), frame.colormap,
+                           frame.visual, frame.depth);
   }
   else {
     frame.depth = _screen->screenInfo().depth();
@@ -1089,6 +1092,9 @@ BlackboxWindow::BlackboxWindow(Blackbox *b, Window w, BScreen *s) {
   frame.utitle = frame.ftitle = frame.uhandle = frame.fhandle = None;
   frame.ulabel = frame.flabel = frame.ubutton = frame.fbutton = None;
   frame.pbutton = frame.ugrip = frame.fgrip = None;
+  frame.ulabel_cache.pixmap = frame.flabel_cache.pixmap = None;
+  frame.label_w = 1;
+  frame.backgrounds = 0;
 
   timer = new bt::Timer(blackbox, this);
   timer->setTimeout(blackbox->resource().autoRaiseDelay());
@@ -1358,8 +1364,11 @@ BlackboxWindow::~BlackboxWindow(void) {
   blackbox->removeEventHandler(frame.window);
   XDestroyWindow(blackbox->XDisplay(), frame.window);
 
-  if (frame.colormap)
+  // ARGB frames use a colormap of their own
+  if (frame.colormap != _screen->screenInfo().colormap()) {
+    bt::Color::removeColormap(frame.colormap);
     XFreeColormap(blackbox->XDisplay(), frame.colormap);
+  }
 }
 
 
@@ -1462,6 +1471,9 @@ void BlackboxWindow::associateClientWindow(void) {
 
 void BlackboxWindow::decorate(void) {
   const WindowStyle &style = _screen->resource().windowStyle();
+  clearLabelCache();
+  // the backgrounds are set again when the new pixmaps are drawn
+  frame.backgrounds = 0;
   if (client.decorations & WindowDecorationTitlebar) {
     // render focused button texture
     frame.fbutton =
@@ -1577,6 +1589,7 @@ void BlackboxWindow::destroyHandle(void) {
   blackbox->removeEventHandler(frame.handle);
   XDestroyWindow(blackbox->XDisplay(), frame.handle);
   frame.handle = None;
+  frame.backgrounds &= ~HandleBackground;
 }
 
 
@@ -1609,6 +1622,7 @@ void BlackboxWindow::destroyGrips(void) {
   XDestroyWindow(blackbox->XDisplay(), frame.left_grip);
   XDestroyWindow(blackbox->XDisplay(), frame.right_grip);
   frame.left_grip = frame.right_grip = None;
+  frame.backgrounds &= ~GripBackground;
 }
 
 
@@ -1649,6 +1663,7 @@ void BlackboxWindow::destroyTitlebar(void) {
   frame.fbutton = frame.ubutton = frame.pbutton =
    frame.ftitle = frame.utitle =
    frame.flabel = frame.ulabel = None;
+  clearLabelCache();
 
   blackbox->removeEventHandler(frame.title);
   blackbox->removeEventHandler(frame.label);
@@ -1656,6 +1671,7 @@ void BlackboxWindow::destroyTitlebar(void) {
   XDestroyWindow(blackbox->XDisplay(), frame.label);
   XDestroyWindow(blackbox->XDisplay(), frame.title);
   frame.title = frame.label = None;
+  frame.backgrounds &= ~(TitleBackground | LabelBackground);
 }
 
 
@@ -2747,6 +2763,23 @@ void BlackboxWindow::setUrgent(bool b) {
 }
 
 
+/*
+ * Makes the texture the background of the frame window, and records
+ * whether the background alone draws it.
+ */
+bool BlackboxWindow::setBackground(unsigned int background,
+                                   const bt::Texture &texture,
+                                   Window window, Pixmap pixmap) const {
+  if (bt::setWindowBackground(_screen->screenNumber(), texture,
+                              window, pixmap)) {
+    frame.backgrounds |= background;
+    return true;
+  }
+  frame.backgrounds &= ~background;
+  return false;
+}
+
+
 void BlackboxWindow::redrawWindowFrame(void) const {
   if (client.decorations & WindowDecorationTitlebar) {
     redrawTitle();
@@ -2759,24 +2792,11 @@ void BlackboxWindow::redrawWindowFrame(void) const {
     const bt::Color &c = (isFocused()
                           ? style.focus.frame_border
                           : style.unfocus.frame_border);
-    // If we have a ARGB visual, the ColorCache assumption about a single
-    // colormaps per screen is no longer valid. Just quickly custom alloc.
-    if (frame.depth < 32) {
-      XSetWindowBorder(blackbox->XDisplay(), frame.plate,
-                       c.pixel(_screen->screenNumber()));
-    }
-    else {
-      XColor xcol;
-      xcol.red   = c.red() | c.red() << 8;
-      xcol.green = c.green() | c.green() << 8;
-      xcol.blue  = c.blue() | c.blue() << 8;
-      xcol.pixel = 0;
-      xcol.flags = DoRed | DoGreen | DoBlue;
-      XAllocColor(blackbox->XDisplay(), frame.colormap, &xcol);
-      XSetWindowBorder(blackbox->XDisplay(), frame.plate,
-                       xcol.pixel);
-      XFreeColors(blackbox->XDisplay(), frame.colormap, &xcol.pixel, 1, 0);
-    }
+    // ARGB frames use a colormap of their own
+    XSetWindowBorder(blackbox->XDisplay(), frame.plate,
+                     (frame.colormap == _screen->screenInfo().colormap())
+                     ? c.pixel(_screen->screenNumber())
+                     : c.colormapPixel(frame.colormap));
   }
 
   if (client.decorations & WindowDecorationHandle) {
@@ -2918,19 +2938,66 @@ void BlackboxWindow::updateEWMHAllowedActions() {
 
 void BlackboxWindow::redrawTitle(void) const {
   const WindowStyle &style = _screen->resource().windowStyle();
+  const bt::Texture &texture =
+    (client.state.focused ? style.focus.title : style.unfocus.title);
+  const Pixmap p = (client.state.focused ? frame.ftitle : frame.utitle);
+  if (setBackground(TitleBackground, texture, frame.title, p)) {
+    XClearWindow(blackbox->XDisplay(), frame.title);
+    return;
+  }
+
   const bt::Rect u(0, 0, frame.rect.width(), style.title_height);
-  bt::drawTexture(_screen->screenNumber(),
-                  (client.state.focused
-                   ? style.focus.title
-                   : style.unfocus.title),
-                  frame.title, u, u,
-                  (client.state.focused
-                   ? frame.ftitle
-                   : frame.utitle));
+  bt::drawTexture(_screen->screenNumber(), texture, frame.title, u, u, p);
 }
 
 
 void BlackboxWindow::redrawLabel(void) const {
+  const WindowStyle &style = _screen->resource().windowStyle();
+  const bool focused = client.state.focused;
+  Pixmap texture = (focused ? frame.flabel : frame.ulabel);
+  if (texture == ParentRelative)
+    texture = (focused ? frame.ftitle : frame.utitle);
+
+  // the texture may still be a placeholder, the label is exposed again
+  // when it is ready
+  if (bt::Image::isRendering(texture)) {
+    frame.backgrounds &= ~LabelBackground;
+    drawLabel(frame.label);
+    return;
+  }
+
+  _frame::LabelCache &cache =
+    (focused ? frame.flabel_cache : frame.ulabel_cache);
+  if (cache.pixmap && cache.width != frame.label_w) {
+    bt::Pen::releaseXftDraw(cache.pixmap);
+    XFreePixmap(blackbox->XDisplay(), cache.pixmap);
+    cache.pixmap = None;
+  }
+
+  if (!cache.pixmap
+      || cache.texture != texture
+      || cache.title_width != frame.rect.width()
+      || cache.title != client.visible_title) {
+    if (!cache.pixmap) {
+      cache.pixmap = XCreatePixmap(blackbox->XDisplay(), frame.label,
+                                   frame.label_w, style.label_height,
+                                   _screen->screenInfo().depth());
+    }
+    cache.texture = texture;
+    cache.width = frame.label_w;
+    cache.title_width = frame.rect.width();
+    cache.title = client.visible_title;
+    drawLabel(cache.pixmap);
+  }
+
+  XSetWindowBackgroundPixmap(blackbox->XDisplay(), frame.label,
+                             cache.pixmap);
+  XClearWindow(blackbox->XDisplay(), frame.label);
+  frame.backgrounds |= LabelBackground;
+}
+
+
+void BlackboxWindow::drawLabel(Drawable drawable) const {
   const WindowStyle &style = _screen->resource().windowStyle();
   bt::Rect u(0, 0, frame.label_w, style.label_height);
   Pixmap p = (client.state.focused ? frame.flabel : frame.ulabel);
@@ -2944,14 +3011,14 @@ void BlackboxWindow::redrawLabel(void) const {
     const bt::Rect t(-(style.title_margin + offset),
                      -(style.title_margin + texture.borderWidth()),
                      frame.rect.width(), style.title_height);
-    bt::drawTexture(_screen->screenNumber(), texture, frame.label, t, u,
+    bt::drawTexture(_screen->screenNumber(), texture, drawable, t, u,
                     (client.state.focused ? frame.ftitle : frame.utitle));
   } else {
     bt::drawTexture(_screen->screenNumber(),
                     (client.state.focused
                      ? style.focus.label
                      : style.unfocus.label),
-                    frame.label, u, u, p);
+                    drawable, u, u, p);
   }
 
   const bt::Pen pen(_screen->screenNumber(),
@@ -2962,11 +3029,26 @@ void BlackboxWindow::redrawLabel(void) const {
               u.top() + style.label_margin,
               u.right() - style.label_margin,
               u.bottom() - style.label_margin);
-  bt::drawText(style.font, pen, frame.label, u,
+  bt::drawText(style.font, pen, drawable, u,
                style.alignment, client.visible_title);
 }
 
 
+void BlackboxWindow::clearLabelCache(void) {
+  _frame::LabelCache * const caches[] = {
+    &frame.ulabel_cache, &frame.flabel_cache
+  };
+  for (unsigned int i = 0; i < 2; ++i) {
+    if (!caches[i]->pixmap)
+      continue;
+    bt::Pen::releaseXftDraw(caches[i]->pixmap);
+    XFreePixmap(blackbox->XDisplay(), caches[i]->pixmap);
+    caches[i]->pixmap = None;
+    caches[i]->title = bt::ustring();
+  }
+}
+
+
 void BlackboxWindow::redrawAllButtons(void) const {
   if (frame.iconify_button) redrawIconifyButton();
   if (frame.maximize_button) redrawMaximizeButton();
@@ -3075,12 +3157,16 @@ void BlackboxWindow::redrawCloseButton(bool pressed) const {
 
 void BlackboxWindow::redrawHandle(void) const {
   const WindowStyle &style = _screen->resource().windowStyle();
+  const bt::Texture &texture =
+    (client.state.focused ? style.focus.handle : style.unfocus.handle);
+  const Pixmap p = (client.state.focused ? frame.fhandle : frame.uhandle);
+  if (setBackground(HandleBackground, texture, frame.handle, p)) {
+    XClearWindow(blackbox->XDisplay(), frame.handle);
+    return;
+  }
+
   const bt::Rect u(0, 0, frame.rect.width(), style.handle_height);
-  bt::drawTexture(_screen->screenNumber(),
-                  (client.state.focused ? style.focus.handle :
-                                          style.unfocus.handle),
-                  frame.handle, u, u,
-                  (client.state.focused ? frame.fhandle : frame.uhandle));
+  bt::drawTexture(_screen->screenNumber(), texture, frame.handle, u, u, p);
 }
 
 
@@ -3089,6 +3175,7 @@ void BlackboxWindow::redrawGrips(void) const {
   const bt::Rect u(0, 0, style.grip_width, style.handle_height);
   Pixmap p = (client.state.focused ? frame.fgrip : frame.ugrip);
   if (p == ParentRelative) {
+    frame.backgrounds &= ~GripBackground;
     bt::Rect t(0, 0, frame.rect.width(), style.handle_height);
     bt::drawTexture(_screen->screenNumber(),
                     (client.state.focused ? style.focus.handle :
@@ -3101,14 +3188,20 @@ void BlackboxWindow::redrawGrips(void) const {
                                             style.unfocus.handle),
                     frame.right_grip, t, u, p);
   } else {
-    bt::drawTexture(_screen->screenNumber(),
-                    (client.state.focused ? style.focus.grip :
-                                            style.unfocus.grip),
-                    frame.left_grip, u, u, p);
+    const bt::Texture &texture =
+      (client.state.focused ? style.focus.grip : style.unfocus.grip);
+    // both grips use the same texture and pixmap
+    if (setBackground(GripBackground, texture, frame.left_grip, p)) {
+      setBackground(GripBackground, texture, frame.right_grip, p);
+      XClearWindow(blackbox->XDisplay(), frame.left_grip);
+      XClearWindow(blackbox->XDisplay(), frame.right_grip);
+      return;
+    }
+    setBackground(GripBackground, texture, frame.right_grip, p);
 
-    bt::drawTexture(_screen->screenNumber(),
-                    (client.state.focused ? style.focus.grip :
-                                            style.unfocus.grip),
+    bt::drawTexture(_screen->screenNumber(), texture,
+                    frame.left_grip, u, u, p);
+    bt::drawTexture(_screen->screenNumber(), texture,
                     frame.right_grip, u, u, p);
   }
 }
@@ -3544,21 +3637,31 @@ void BlackboxWindow::exposeEvent(const XExposeEvent * const event) {
   fprintf(stderr, gettext("BlackboxWindow::exposeEvent() for 0x%lx\n"), client.window);
 #endif
 
-  if (frame.title == event->window)
-    redrawTitle();
-  else if (frame.label == event->window)
-    redrawLabel();
+  // the decorations are redrawn whole, once for all rectangles
+  if (event->count > 0)
+    return;
+
+  if (frame.title == event->window) {
+    if (!(frame.backgrounds & TitleBackground))
+      redrawTitle();
+  } else if (frame.label == event->window) {
+    if (!(frame.backgrounds & LabelBackground))
+      redrawLabel();
+  }
   else if (frame.close_button == event->window)
     redrawCloseButton();
   else if (frame.maximize_button == event->window)
     redrawMaximizeButton();
   else if (frame.iconify_button == event->window)
     redrawIconifyButton();
-  else if (frame.handle == event->window)
-    redrawHandle();
-  else if (frame.left_grip == event->window ||
-           frame.right_grip == event->window)
-    redrawGrips();
+  else if (frame.handle == event->window) {
+    if (!(frame.backgrounds & HandleBackground))
+      redrawHandle();
+  } else if (frame.left_grip == event->window ||
+             frame.right_grip == event->window) {
+    if (!(frame.backgrounds & GripBackground))
+      redrawGrips();
+  }
 }
 
 
@@ -3778,8 +3881,7 @@ void BlackboxWindow::enterNotifyEvent(const XCrossingEvent * const event) {
   XEvent next;
   bool leave = False, inferior = False;
 
-  while (XCheckTypedWindowEvent(blackbox->XDisplay(), event->window,
-                                LeaveNotify, &next)) {
+  while (blackbox->checkTypedWindowEvent(event->window, LeaveNotify, &next)) {
     if (next.type == LeaveNotify && next.xcrossing.mode == NotifyNormal) {
       leave = True;
       inferior = (next.xcrossing.detail == NotifyInferior);
@@ -3858,8 +3960,8 @@ void BlackboxWindow::restore(void) {
   blackbox->XUngrabServer();
 
   XEvent unused;
-  if (!XCheckTypedWindowEvent(blackbox->XDisplay(), client.window,
-                              ReparentNotify, &unused)) {
+  if (!blackbox->checkTypedWindowEvent(client.window, ReparentNotify,
+                                      &unused)) {
     /*
       according to the ICCCM, the window manager is responsible for
       reparenting the window back to root... however, we don't want to
@@ -239,8 +239,34 @@ class BlackboxWindow : public StackEntity, public bt::TimeoutHandler,
     int grab_x, grab_y;         // where was the window when it was grabbed?
 
     unsigned int label_w;       // width of the label
+
+    /*
+      the label texture and text are composed into these pixmaps,
+      which are reused until the title, the geometry or the style
+      changes
+    */
+    struct LabelCache {
+      Pixmap pixmap, texture;
+      unsigned int width, title_width;
+      bt::ustring title;
+    };
+    mutable LabelCache ulabel_cache, flabel_cache;
+
+    // the FrameBackground windows that need no redraw on expose
+    mutable unsigned int backgrounds;
   } frame;
 
+  /*
+    Frame windows whose background is the complete decoration, so that
+    the X server repaints them without a redraw.
+  */
+  enum FrameBackground {
+    TitleBackground  = (1 << 0),
+    LabelBackground  = (1 << 1),
+    HandleBackground = (1 << 2),
+    GripBackground   = (1 << 3)
+  };
+
   Window createToplevelWindow();
   Window createChildWindow(Window parent, unsigned long event_mask,
                            Cursor = None, Visual* = 0);
@@ -265,9 +291,13 @@ class BlackboxWindow : public StackEntity, public bt::TimeoutHandler,
   void createCloseButton(void);
   void destroyCloseButton(void);
 
+  bool setBackground(unsigned int background, const bt::Texture &texture,
+                     Window window, Pixmap pixmap) const;
   void redrawWindowFrame(void) const;
   void redrawTitle(void) const;
   void redrawLabel(void) const;
+  void drawLabel(Drawable drawable) const;
+  void clearLabelCache(void);
   void redrawAllButtons(void) const;
   void redrawCloseButton(bool pressed = false) const;
   void redrawIconifyButton(bool pressed = false) const;
@@ -301,7 +301,7 @@ void Blackbox::process_event(XEvent *e) {
     XEvent event;
 
     XSync(XDisplay(), False);
-    if (XCheckIfEvent(XDisplay(), &event, scanForFocusIn, NULL)) {
+    if (checkIfEvent(&event, scanForFocusIn, NULL)) {
       process_event(&event);
 
       if (event.xfocus.window == None)
@@ -404,6 +404,7 @@ void Blackbox::timeout(bt::Timer *) {
   bt::Color::clearCache();
   bt::Font::clearCache();
   bt::PixmapCache::clearCache();
+  bt::Pen::clearCache();
 }
 
 
@@ -529,35 +530,49 @@ BScreen* Blackbox::screenNumber(unsigned int n) {
 
 
 BlackboxWindow *Blackbox::findWindow(Window window) const {
-  WindowLookup::const_iterator it = windowSearchList.find(window);
-  if (it != windowSearchList.end())
-    return it->second;
-  return 0;
+  const WindowLookup *it = windowSearchList.find(window);
+  return it ? it->window : 0;
 }
 
 
-void Blackbox::insertWindow(Window window, BlackboxWindow *data)
-{ windowSearchList.insert(WindowLookupPair(window, data)); }
+void Blackbox::insertWindow(Window window, BlackboxWindow *data) {
+  WindowLookup &it = windowSearchList[window];
+  if (!it.window)
+    it.window = data;
+}
 
 
-void Blackbox::removeWindow(Window window)
-{ windowSearchList.erase(window); }
+void Blackbox::removeWindow(Window window) {
+  WindowLookup *it = windowSearchList.find(window);
+  if (!it)
+    return;
+  it->window = 0;
+  if (!it->group)
+    windowSearchList.erase(window);
+}
 
 
 BWindowGroup *Blackbox::findWindowGroup(Window window) const {
-  GroupLookup::const_iterator it = groupSearchList.find(window);
-  if (it != groupSearchList.end())
-    return it->second;
-  return 0;
+  const WindowLookup *it = windowSearchList.find(window);
+  return it ? it->group : 0;
 }
 
 
-void Blackbox::insertWindowGroup(Window window, BWindowGroup *data)
-{ groupSearchList.insert(GroupLookupPair(window, data)); }
+void Blackbox::insertWindowGroup(Window window, BWindowGroup *data) {
+  WindowLookup &it = windowSearchList[window];
+  if (!it.group)
+    it.group = data;
+}
 
 
-void Blackbox::removeWindowGroup(Window window)
-{ groupSearchList.erase(window); }
+void Blackbox::removeWindowGroup(Window window) {
+  WindowLookup *it = windowSearchList.find(window);
+  if (!it)
+    return;
+  it->group = 0;
+  if (!it->window)
+    windowSearchList.erase(window);
+}
 
 
 void Blackbox::setFocusedWindow(BlackboxWindow *win) {
@@ -589,6 +604,9 @@ void Blackbox::restart(const std::string &prog) {
   */
   shutdown();
 
+  // don't pass the blocked signals on to the new process
+  restoreSignalMask();
+
   if (! prog.empty()) {
     std::string cmd = "exec ";
     cmd += prog;
@@ -27,6 +27,7 @@
 
 #include <Application.hh>
 #include <Util.hh>
+#include <XIDTable.hh>
 
 extern "C" {
 #include <X11/Xatom.h>
@@ -61,13 +62,15 @@ private:
   size_t screen_list_count;
   BScreen *active_screen;
 
-  typedef std::map<Window, BlackboxWindow*> WindowLookup;
-  typedef WindowLookup::value_type WindowLookupPair;
-  WindowLookup windowSearchList;
-
-  typedef std::map<Window, BWindowGroup*> GroupLookup;
-  typedef GroupLookup::value_type GroupLookupPair;
-  GroupLookup groupSearchList;
+  // a window can be both a client and the leader of a group, so
+  // both lookups share one entry per window
+  struct WindowLookup {
+    BlackboxWindow *window;
+    BWindowGroup *group;
+    inline WindowLookup(void) : window(0), group(0) { }
+  };
+  typedef bt::XIDTable<WindowLookup> WindowLookupTable;
+  WindowLookupTable windowSearchList;
 
   bt::EWMH* _ewmh;
 
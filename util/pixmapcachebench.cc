@@ -0,0 +1,94 @@
+// -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; -*-
+// pixmapcachebench - measures bt::PixmapCache lookups
+// Copyright (c) 2001 - 2005 Sean 'Shaleh' Perry <shaleh at debian.org>
+// Copyright (c) 1997 - 2000, 2002 - 2005
+//         Bradley T Hughes <bhughes at trolltech.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+/*
+  Renders a growing number of small gradients into the pixmap cache and
+  measures how long it takes to find one that is already cached.  The
+  time per lookup should not grow with the number of cached pixmaps.
+  Needs an X server.
+*/
+
+#include <Display.hh>
+#include <PixmapCache.hh>
+#include <Texture.hh>
+#include <Timer.hh>
+
+#include <X11/Xlib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+static bt::Texture gradient(unsigned int n) {
+  bt::Texture texture;
+  texture.setTexture(bt::Texture::Gradient | bt::Texture::Vertical);
+  texture.setColor1(bt::Color(n & 0xff, (n >> 8) & 0xff, (n >> 16) & 0xff));
+  texture.setColor2(bt::Color(0, 0, 0));
+  return texture;
+}
+
+
+int main(int argc, char **argv) {
+  const char *display_name = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-display") && i + 1 < argc)
+      display_name = argv[++i];
+  }
+
+  bt::Display display(display_name, false);
+  bt::PixmapCache::setCacheLimit(64ul * 1024ul);
+
+  const unsigned int sizes[] = { 100u, 1000u, 10000u, 20000u };
+  const unsigned int lookups = 200000u;
+
+  printf("%8s %12s\n", "cached", "ns/lookup");
+  for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const unsigned int count = sizes[s];
+    std::vector<bt::Texture> textures;
+    std::vector<Pixmap> pixmaps;
+    for (unsigned int i = 0; i < count; ++i) {
+      textures.push_back(gradient(i));
+      pixmaps.push_back(bt::PixmapCache::find(0, textures.back(), 4, 4));
+    }
+    XSync(display.XDisplay(), False);
+
+    const bt::timeval start = bt::monotonicTime();
+    for (unsigned int i = 0; i < lookups; ++i) {
+      const bt::Texture &texture = textures[(i * 7919u) % count];
+      bt::PixmapCache::release(bt::PixmapCache::find(0, texture, 4, 4));
+    }
+    const bt::timeval end = bt::monotonicTime();
+
+    const double ns = ((end.tv_sec - start.tv_sec) * 1e9
+                       + (end.tv_usec - start.tv_usec) * 1e3);
+    printf("%8u %12.1f\n", count, ns / lookups);
+
+    for (unsigned int i = 0; i < count; ++i)
+      bt::PixmapCache::release(pixmaps[i]);
+    bt::PixmapCache::clearCache();
+  }
+
+  return 0;
+}
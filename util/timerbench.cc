@@ -0,0 +1,172 @@
+// -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; -*-
+// timerbench - measures bt::TimerQueue
+// Copyright (c) 2001 - 2005 Sean 'Shaleh' Perry <shaleh at debian.org>
+// Copyright (c) 1997 - 2000, 2002 - 2005
+//         Bradley T Hughes <bhughes at trolltech.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+/*
+  Starts thousands of timers and then stops, restarts and reschedules
+  them at random through bt::TimerQueue, and through a heap that
+  removes timers with a linear search, as the queue did before it
+  indexed its timers.  Afterwards the queue is drained to check that
+  the timers still come out in order.
+*/
+
+#include <Timer.hh>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+
+class IndexedManager : public bt::TimerQueueManager {
+public:
+  bt::TimerQueue queue;
+  void addTimer(bt::Timer *timer)
+  { queue.push(timer); }
+  void removeTimer(bt::Timer *timer)
+  { queue.release(timer); }
+};
+
+
+class LinearManager : public bt::TimerQueueManager {
+public:
+  struct Later {
+    inline bool operator()(const bt::Timer *a, const bt::Timer *b) const
+    { return b->endpoint() < a->endpoint(); }
+  };
+  std::vector<bt::Timer *> heap;
+  void addTimer(bt::Timer *timer) {
+    removeTimer(timer);
+    heap.push_back(timer);
+    std::push_heap(heap.begin(), heap.end(), Later());
+  }
+  void removeTimer(bt::Timer *timer) {
+    std::vector<bt::Timer *>::iterator it =
+      std::find(heap.begin(), heap.end(), timer);
+    if (it == heap.end())
+      return;
+    heap.erase(it);
+    std::make_heap(heap.begin(), heap.end(), Later());
+  }
+};
+
+
+static double elapsed(const bt::timeval &start) {
+  const bt::timeval end = bt::monotonicTime();
+  return ((end.tv_sec - start.tv_sec) * 1e9
+          + (end.tv_usec - start.tv_usec) * 1e3);
+}
+
+
+// stops, restarts or reschedules random timers, returns ns per call
+static double churn(std::vector<bt::Timer *> &timers, unsigned int calls) {
+  const bt::timeval start = bt::monotonicTime();
+  for (unsigned int i = 0; i < calls; ++i) {
+    bt::Timer * const timer = timers[rand() % timers.size()];
+    switch (i % 3) {
+    case 0:
+      timer->stop();
+      break;
+    case 1:
+      timer->start();
+      break;
+    default:
+      timer->setTimeout(rand() % 60000);
+      timer->start();
+      break;
+    }
+  }
+  return elapsed(start) / calls;
+}
+
+
+template <typename Manager>
+static std::vector<bt::Timer *> startTimers(Manager &manager,
+                                            unsigned int count) {
+  std::vector<bt::Timer *> timers;
+  for (unsigned int i = 0; i < count; ++i) {
+    bt::Timer * const timer = new bt::Timer(&manager, 0);
+    timer->setTimeout(rand() % 60000);
+    timer->start();
+    timers.push_back(timer);
+  }
+  return timers;
+}
+
+
+static void deleteTimers(std::vector<bt::Timer *> &timers) {
+  for (unsigned int i = 0; i < timers.size(); ++i)
+    delete timers[i];
+  timers.clear();
+}
+
+
+int main(void) {
+  const unsigned int sizes[] = { 1000u, 10000u, 100000u };
+  bool ordered = true;
+
+  printf("%8s %14s %14s\n", "timers", "indexed ns", "linear ns");
+  for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const unsigned int count = sizes[s];
+    srand(count);
+
+    IndexedManager indexed;
+    std::vector<bt::Timer *> timers = startTimers(indexed, count);
+    const double indexed_ns = churn(timers, 1000000u);
+
+    // the timers still running must come out in order
+    size_t running = 0;
+    for (unsigned int i = 0; i < timers.size(); ++i)
+      running += timers[i]->isTiming();
+    if (indexed.queue.size() != running)
+      ordered = false;
+    bt::timeval last;
+    for (bool first = true; !indexed.queue.empty(); first = false) {
+      bt::Timer * const timer = indexed.queue.top();
+      if (!first && timer->endpoint() < last)
+        ordered = false;
+      last = timer->endpoint();
+      indexed.queue.pop();
+      timer->halt();
+    }
+    deleteTimers(timers);
+
+    // the linear search is slow, do fewer calls
+    LinearManager linear;
+    timers = startTimers(linear, count);
+    const double linear_ns =
+      churn(timers, std::min(2000u, 20000000u / count));
+    linear.heap.clear();
+    for (unsigned int i = 0; i < timers.size(); ++i)
+      timers[i]->halt();
+    deleteTimers(timers);
+
+    printf("%8u %14.1f %14.1f\n", count, indexed_ns, linear_ns);
+  }
+
+  if (!ordered) {
+    fprintf(stderr, "timerbench: timers out of order\n");
+    return 1;
+  }
+  return 0;
+}
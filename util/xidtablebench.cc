@@ -0,0 +1,113 @@
+// -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 2; -*-
+// xidtablebench - compares bt::XIDTable with std::map
+// Copyright (c) 2001 - 2005 Sean 'Shaleh' Perry <shaleh at debian.org>
+// Copyright (c) 1997 - 2000, 2002 - 2005
+//         Bradley T Hughes <bhughes at trolltech.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+// THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+/*
+  Compares bt::XIDTable with the std::map it replaced for looking up
+  windows, with 10000 and 20000 ids spread over a few clients like the
+  windows a window manager sees.  Measures random lookups, and churn
+  where windows are destroyed and created while the table is full.
+*/
+
+#include <Timer.hh>
+#include <XIDTable.hh>
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+
+static double elapsed(const bt::timeval &start) {
+  const bt::timeval end = bt::monotonicTime();
+  return ((end.tv_sec - start.tv_sec) * 1e9
+          + (end.tv_usec - start.tv_usec) * 1e3);
+}
+
+
+// X servers hand out ids from a per-client base
+static XID windowId(unsigned int n)
+{ return (static_cast<XID>(n % 32u + 1u) << 21) | (n / 32u + 1u); }
+
+
+int main(void) {
+  const unsigned int sizes[] = { 10000u, 20000u };
+  const unsigned int lookups = 2000000u, churn = 500000u;
+
+  printf("%8s %16s %16s %16s %16s\n", "ids", "table lookup ns",
+         "map lookup ns", "table churn ns", "map churn ns");
+  for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    const unsigned int count = sizes[s];
+    std::vector<XID> ids;
+    for (unsigned int i = 0; i < count; ++i)
+      ids.push_back(windowId(i));
+
+    bt::XIDTable<void *> table;
+    std::map<XID, void *> map;
+    for (unsigned int i = 0; i < count; ++i) {
+      table[ids[i]] = &ids[i];
+      map[ids[i]] = &ids[i];
+    }
+
+    // sum the results, so the lookups are not optimized away
+    unsigned long sum = 0ul;
+    bt::timeval start = bt::monotonicTime();
+    for (unsigned int i = 0; i < lookups; ++i)
+      sum += *table.find(ids[(i * 7919u) % count]) != 0;
+    const double table_lookup = elapsed(start) / lookups;
+
+    start = bt::monotonicTime();
+    for (unsigned int i = 0; i < lookups; ++i)
+      sum += map.find(ids[(i * 7919u) % count])->second != 0;
+    const double map_lookup = elapsed(start) / lookups;
+
+    // destroy a window and create one with a new id
+    std::vector<XID> table_ids(ids), map_ids(ids);
+    start = bt::monotonicTime();
+    for (unsigned int i = 0; i < churn; ++i) {
+      XID &id = table_ids[(i * 7919u) % count];
+      table.erase(id);
+      id = windowId(count + i);
+      table[id] = &id;
+    }
+    const double table_churn = elapsed(start) / churn;
+
+    start = bt::monotonicTime();
+    for (unsigned int i = 0; i < churn; ++i) {
+      XID &id = map_ids[(i * 7919u) % count];
+      map.erase(id);
+      id = windowId(count + i);
+      map[id] = &id;
+    }
+    const double map_churn = elapsed(start) / churn;
+
+    if (sum != 2ul * lookups || table.size() != map.size()) {
+      fprintf(stderr, "xidtablebench: table and map disagree\n");
+      return 1;
+    }
+
+    printf("%8u %16.1f %16.1f %16.1f %16.1f\n", count,
+           table_lookup, map_lookup, table_churn, map_churn);
+  }
+
+  return 0;
+}